@@ -0,0 +1,115 @@
+#ifndef BRAINFUCKPP_H
+#define BRAINFUCKPP_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// --- libbfpp ---
+//
+// Embedding API of the BrainFuck++ interpreter. Build the interpreter with
+// -DBFPP_NO_MAIN to use it as a library.
+//
+// A Program is compiled once and never modified afterwards, so one Program
+// can be run by any number of Machines at the same time, on any threads. A
+// Machine is the state of one execution (tape, pointers, buffered I/O); it
+// is cheap to create and must only be used by one thread at a time.
+
+typedef struct Program Program;
+typedef struct Machine Machine;
+
+// Options that affect how code is compiled
+typedef struct {
+    const char* cache_dir;     // NULL: always compile from source
+    unsigned prefix_budget_ms; // Time allowed for compile-time prefix evaluation (0 = off)
+    unsigned io_cell_size;     // Bytes moved by '.' and ',': 1, or 4/8 for whole cells (--io)
+    unsigned parallel_regions; // Threads per machine for disjoint () blocks (0 or 1 = off)
+} CompileOptions;
+
+// Returned by MachineIo.read when no input is available yet
+#define BFPP_WOULD_BLOCK (-2)
+
+// Where a Machine's ',' reads from and '.' writes to
+typedef struct {
+    // Reads up to capacity bytes into buffer. Returns the number of bytes
+    // read, 0 at the end of input or -1 on error. NULL: there is no input.
+    // A non-blocking source returns BFPP_WOULD_BLOCK when it has nothing
+    // yet; run_slice then stops before the ',' with SLICE_NEEDS_INPUT.
+    long (*read)(void* context, unsigned char* buffer, size_t capacity);
+    // Writes all length bytes. Returns 0 on success, -1 on error.
+    // NULL: output is kept in memory, see captured_output.
+    int (*write)(void* context, const char* data, size_t length);
+    void* read_context;
+    void* write_context;
+    int interactive;           // Flush output before every ',' (input is a terminal)
+} MachineIo;
+
+// Where run_slice stopped
+typedef enum {
+    SLICE_DONE,        // Reached the end of the program
+    SLICE_OUT_OF_FUEL, // Used up its fuel; call run_slice again to continue
+    SLICE_NEEDS_INPUT, // Waiting for non-blocking input; call again once it has arrived
+    SLICE_ERROR        // Runtime error (already reported)
+} SliceStatus;
+
+// When buffered output is written out (--flush)
+typedef enum {
+    FLUSH_BLOCK,       // When the buffer is full
+    FLUSH_LINE,        // Also after every newline
+    FLUSH_INTERACTIVE  // After every output command
+} FlushPolicy;
+
+// I/O on file descriptors. Regular input files are memory-mapped, and the
+// flush policy defaults to line buffering when output is a terminal. An
+// O_NONBLOCK input descriptor reads as BFPP_WOULD_BLOCK when it is empty.
+MachineIo fd_io(int input_fd, int output_fd);
+
+// Compiles source; options may be NULL. Returns NULL (after reporting the
+// error on stderr) if the code is invalid.
+Program* compile_program(const char* source, const CompileOptions* options);
+void free_program(Program* program);
+int emit_c_source(const Program* program, FILE* out);
+int emit_shared_library(const Program* program, const char* path);
+
+// Creates a Machine at the start of program; io may be NULL (no input,
+// output kept in memory). program must outlive the Machine.
+Machine* create_machine(const Program* program, const MachineIo* io);
+void free_machine(Machine* machine);
+// Runs to completion (or the instruction limit) and flushes the output,
+// waiting for a non-blocking input descriptor when it is empty.
+// Returns 0 on success, -1 on a runtime error.
+int run(Machine* machine);
+// Runs at most fuel instructions, then flushes the output. After
+// SLICE_OUT_OF_FUEL the next call (or run) continues exactly where this one
+// stopped, so one thread can take turns running many machines. The
+// instruction limit does not apply to slices.
+SliceStatus run_slice(Machine* machine, size_t fuel);
+// Instructions run executes before giving up (default 100000000, 0 =
+// unlimited). Set it before the machine starts running.
+void set_instruction_limit(Machine* machine, size_t limit);
+// Wall-clock time each run may take (default 0 = unlimited). It is checked
+// only where loops jump back, so waiting for input is not cut short. Like
+// the instruction limit, it ends run with a warning, not an error.
+void set_time_limit(Machine* machine, unsigned milliseconds);
+// Instructions executed so far, exact whenever run or run_slice has returned
+size_t instructions_executed(const Machine* machine);
+void set_flush_policy(Machine* machine, FlushPolicy policy);
+int start_io_threads(Machine* machine);
+// Checkpoints (--checkpoint-every, --restore). save_checkpoint writes the
+// machine's whole state to path (replacing it atomically) after flushing
+// its output. restore_checkpoint, called on a new Machine for the same
+// program before it runs, continues from it: the input is skipped to where
+// the checkpointed run was, and a regular output file is cut back to it.
+// Both return 0 on success, -1 (after reporting it) on failure.
+int save_checkpoint(Machine* machine, const char* path);
+int restore_checkpoint(Machine* machine, const char* path);
+// Makes run save a checkpoint to path every interval_ms (0 = never)
+void set_checkpointing(Machine* machine, const char* path, unsigned interval_ms);
+// Output kept in memory by a Machine without a write callback
+const char* captured_output(const Machine* machine, size_t* length);
+int enable_profiling(Machine* machine, const char* source);
+void print_profile(const Machine* machine, FILE* out);
+// Runs the machine on the tracing engine, which prints every command to
+// stderr; the default engine has no tracing code at all
+void enable_tracing(Machine* machine);
+
+#endif // BRAINFUCKPP_H
@@ -2,12 +2,60 @@
 #include <stdio.h>
 #include <string.h> // For strlen, strchr, memset
 #include <ctype.h>  // For isspace
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>     // For open
+#include <unistd.h>    // For close, write, getpid
+#include <sys/mman.h>  // For mmap (compiled code cache)
+#include <sys/stat.h>  // For fstat, mkdir
+#include <stdarg.h>
+#include <limits.h>    // For LONG_MIN
+#include <time.h>      // For clock_gettime (prefix evaluation budget)
+#include <spawn.h>     // For posix_spawnp (shared library backend)
+#include <sys/wait.h>
+#include <stdatomic.h>    // For the --io-thread rings
+#include <pthread.h>
+#include <sys/syscall.h>  // For futex
+#include <linux/futex.h>
+#include <sys/socket.h>   // For --serve
+#include <sys/un.h>
+#include <signal.h>
+#include <poll.h>       // For waiting on non-blocking input
+#include <sys/eventfd.h> // For waking the --io-thread reader at shutdown
+#include "brainfuckpp.h"
 
 // --- Constants ---
 #define MAX_NESTING_DEPTH 1024 // Unified max depth for [] and ()
 #define MAX_CODE_SIZE 65536    // Max filtered code size
 #define MAX_POINTER_STACK_DEPTH 256 // Max nesting depth for ()
 #define COMMENT_CHAR '#'
+#define MAX_INSTRUCTIONS 100000000
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+#define INPUT_BUFFER_SIZE (1 << 16)
+#define IO_RING_SIZE (1 << 20)  // Per direction, with --io-thread (power of two)
+#define IO_RING_SPIN 1024       // Polls before sleeping on a full/empty ring
+
+// Compile-time evaluation of the input-independent prefix (cache only)
+#define DEFAULT_PREFIX_BUDGET_MS 100
+#define PREFIX_EVAL_CHUNK (1 << 16)            // Instructions between budget checks
+#define PREFIX_EVAL_MAX_OUTPUT (1 << 20)       // Give up on output larger than this
+
+// Snapshots and checkpoints (--checkpoint-every, --restore)
+#define SNAPSHOT_MIN_GAP 8                     // Shortest run of zero cells left out of a snapshot
+#define CHECKPOINT_MAGIC "BFPPCKP"             // 8 bytes including the implicit terminator
+#define CHECKPOINT_CHUNK (1 << 24)             // Instructions between checks of the clock
+
+// Version of the compiler; part of the compiled-code cache key so that a
+// new interpreter never picks up artifacts produced by an older one.
+#define BFPP_VERSION "0.2.0"
+#define CACHE_MAGIC "BFPPC\0\0"  // 8 bytes including the implicit terminator
+#define CACHE_FORMAT_VERSION 5
+#define CACHE_FILE_SUFFIX ".bfppc"
+
+// Internal commands produced by the optimizer. They replace the first
+// command of the code they stand for, so they never collide with source.
+#define OP_WRITE_LITERAL 'L'   // Folded constant output, see fold_constant_output
+#define OP_COPY_LOOP 'C'       // Replaces the '[' of an input-to-output loop, see mark_copy_loops
 
 // Enum for paired symbol types
 typedef enum {
@@ -26,7 +74,7 @@ struct Node {
     Node *prev;
 };
 
-// Forward declare Pointer for Interpreter struct and function signatures
+// Forward declare Pointer for Machine struct and function signatures
 typedef struct Pointer Pointer;
 
 // Pointer structure with function pointers (OOP-like approach)
@@ -57,29 +105,233 @@ Pointer* create_pointer();
 void free_pointer_tape(Pointer *p); // Function to free the linked list
 Pointer* create_temp_pointer(Pointer *self); // Creates a temp pointer pointing to the same node
 
-// Interpreter state structure
-typedef struct Interpreter {
+// Single-producer single-consumer byte ring between the interpreter and an
+// I/O thread (--io-thread). head and tail only grow; the producer owns tail
+// and the consumer owns head. A side that finds the ring full (or empty)
+// sleeps on the futex word wake_seq, and the other side only makes the
+// wake-up syscall when somebody is actually asleep, so while data flows
+// neither side enters the kernel for the ring itself.
+typedef struct {
+    unsigned char* data;
+    size_t capacity;            // Power of two
+    _Atomic size_t head;        // Bytes consumed so far
+    _Atomic size_t tail;        // Bytes produced so far
+    _Atomic int closed;         // The other side has gone away (EOF or shutdown)
+    _Atomic uint32_t wake_seq;  // Futex word
+    _Atomic uint32_t sleepers;
+} ByteRing;
+
+// Background I/O threads. The writer drains output to out_fd; the reader
+// fills input from in_fd and is started by the first ',' that needs it.
+typedef struct IoThreads {
+    ByteRing output;
+    ByteRing input;
+    int out_fd;                 // -1 when output is not threaded
+    int in_fd;                  // -1 when input is not threaded
+    pthread_t writer;
+    pthread_t reader;
+    int writer_running;
+    int reader_running;
+    int wake_fd;                // eventfd that wakes the reader to stop, or -1
+    _Atomic int write_failed;
+} IoThreads;
+
+// Output buffer owned by a machine. '.' stores bytes directly into it, and
+// it is handed to the write callback according to the flush policy. Output
+// is always flushed before a ',' that reads from a terminal and when run()
+// finishes. A buffer without a write callback grows instead of flushing,
+// which is used to capture output in memory.
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+    int (*write)(void* context, const char* data, size_t length); // NULL: capture
+    void* context;
+    int fd;                 // Destination descriptor when write is write_fd, or -1
+    FlushPolicy policy;
+    int flush_before_input; // Input is a terminal
+    int failed;             // A write failed; further output is discarded
+    IoThreads* io;          // Non-NULL: flushes go to the writer thread's ring
+} OutputBuffer;
+
+// Input source for ','. A regular file is mapped into memory and consumed
+// by advancing pos; anything else (pipes, terminals, callbacks) is read in
+// large blocks. Once the end is reached it stays reached.
+typedef struct {
+    const unsigned char* pos;  // Next unread byte
+    const unsigned char* end;  // End of the bytes available without a refill
+    unsigned char* buffer;     // Read buffer (NULL when mapped)
+    size_t capacity;
+    void* mapping;             // Mapped file, or NULL
+    size_t mapping_size;
+    off_t mapping_start;       // File offset corresponding to mapping
+    long (*read)(void* context, unsigned char* buffer, size_t capacity); // NULL: no input
+    void* context;
+    int fd;                    // Source descriptor when read is read_fd, or -1
+    int eof;
+    IoThreads* io;             // Non-NULL: refills come from the reader thread's ring
+    size_t ring_held;          // Ring bytes exposed through pos/end, consumed on refill
+    unsigned char partial[sizeof(int64_t)]; // Start of a cell whose rest is not available yet
+    size_t partial_length;
+    uint64_t delivered;        // Bytes made available through pos/end so far
+} InputBuffer;
+
+#define INPUT_AGAIN (-2) // From input_refill, input_byte and input_cell: no input yet, try later
+
+// A run of straight-line code whose output is known at compile time,
+// executed by OP_WRITE_LITERAL as one bulk write plus its tape effects
+typedef struct {
+    uint32_t end;            // ip just past the folded code
+    char original;           // Command replaced by OP_WRITE_LITERAL
+    uint32_t output_offset;  // Output bytes in literal_bytes
+    uint32_t output_length;
+    uint32_t delta_offset;   // Cell changes in literal_deltas, by ascending offset
+    uint32_t delta_count;
+    int32_t move;            // Net pointer movement
+} LiteralOp;
+
+typedef struct {
+    int32_t offset;          // Relative to the pointer at the start of the op
+    int32_t delta;
+} CellDelta;
+
+// A () region that moves only by statically known amounts and does no I/O,
+// see find_parallel_groups
+typedef struct {
+    uint32_t open, close;    // Positions of its '(' and ')'
+    int32_t base;            // Offset of its '(' from the group's first '('
+    int32_t lo, hi;          // Cells it touches, relative to its '('
+    uint32_t depth;          // Deepest () nesting, counting its own
+    uint64_t work;           // Estimated commands executed
+} ParallelRegion;
+
+// Consecutive regions, separated only by '<'/'>', that touch disjoint cells
+// and so can run at the same time
+typedef struct {
+    uint32_t end;            // ip just past the last region's ')'
+    uint32_t first_region;   // In parallel_regions
+    uint32_t region_count;
+    int32_t lo, hi;          // Cells touched by all regions, relative to the first '('
+    int32_t move;            // Net pointer movement (the '<'/'>' in between)
+    uint32_t between;        // Number of those '<'/'>'
+    uint32_t depth;          // Deepest () nesting of any region
+} ParallelGroup;
+
+typedef struct RegionPool RegionPool;
+typedef struct Deadline Deadline;
+
+// Position of a filtered command in the original source (1-based)
+typedef struct {
+    uint32_t line;
+    uint32_t column;
+} SourcePos;
+
+// A compiled program. Nothing in it changes after compile_program returns,
+// so it may be shared by machines running on different threads.
+struct Program {
     char* code;             // Filtered BrainFuck++ code
     size_t code_length;     // Length of the filtered code
     int* bracket_map;       // Maps '[' to ']' and vice versa
     int* paren_map;         // Maps '(' to ')' and vice versa
+    uint64_t code_hash;     // hash_code of the filtered code before optimization
+    size_t io_cell_size;    // 1: byte I/O; 4 or 8: '.' and ',' move whole cells in native byte order
+
+    // Tables for OP_WRITE_LITERAL; bracket_map holds the LiteralOp index
+    LiteralOp* literal_ops;
+    size_t literal_op_count;
+    char* literal_bytes;
+    size_t literal_bytes_length;
+    CellDelta* literal_deltas;
+    size_t literal_delta_count;
+
+    // State every machine starts from, after compile-time prefix evaluation
+    // (see evaluate_prefix); NULL to start at the beginning
+    const char* snapshot;
+    size_t snapshot_size;
+    char* owned_snapshot;   // Backing buffer when not inside the cache mapping
+
+    void* cache_mapping;    // Non-NULL when code/maps point into an mmap'd cache file
+    size_t cache_mapping_size;
+
+    // () regions run in parallel (see find_parallel_groups); never cached,
+    // parallel_group_at is NULL when disabled
+    unsigned parallel_threads;  // Threads per machine, including its own
+    int* parallel_group_at;     // Group whose first '(' is at each position, or -1
+    ParallelGroup* parallel_groups;
+    size_t parallel_group_count;
+    ParallelRegion* parallel_regions;
+    size_t parallel_region_count;
+
+    // Commands from each position through the end of its block (see
+    // compute_block_costs); never cached, it depends on the parallel groups
+    uint32_t* block_cost;
+};
+
+// One execution of a program
+struct Machine {
+    const Program* program;
 
     Pointer* main_pointer;  // The primary data pointer operating on the tape
 
     Pointer* pointer_stack[MAX_POINTER_STACK_DEPTH]; // Stack for temporary pointers from ()
     int pointer_stack_top;   // Index of the current top (-1 for empty, 0 for main_pointer)
 
-    FILE* input;            // Input stream
-    FILE* output;           // Output stream
-} Interpreter;
+    OutputBuffer out;       // Buffered output
+    InputBuffer in;         // Buffered (or mapped) input
+    IoThreads* io;          // --io-thread, or NULL
+    RegionPool* region_pool; // Threads for parallel () groups, started on first use
+
+    // Execution state, kept here so that execution can stop and resume
+    size_t ip;               // Next command to execute
+    Pointer* active_pointer; // main_pointer, or the innermost temporary pointer
+    size_t instruction_count;
+    size_t instruction_limit; // run() stops here; 0 = unlimited
+    unsigned time_limit_ms;  // run() stops after this long; 0 = unlimited
+    Deadline* deadline;      // Timer for time_limit_ms while run() runs, or NULL
+    const char* checkpoint_path;     // run() saves checkpoints here (see set_checkpointing)
+    unsigned checkpoint_interval_ms; // 0 = no checkpoints
+    unsigned long last_checkpoint_ms;
+    int suppress_errors;     // Don't report runtime errors (compile-time evaluation)
+    int at_prefix_snapshot;  // Still in the program's snapshot state: not run or restored yet
+
+    // Output already produced by compile-time prefix evaluation, written
+    // out before execution resumes (points into the program's snapshot)
+    const char* pending_output;
+    size_t pending_output_length;
 
-// Helper & Interpreter Lifecycle functions (implementations below)
+    // Profiling (--profile); both NULL when disabled
+    SourcePos* source_map;  // Source position of each filtered command
+    size_t* profile_counts; // Execution count of each filtered command
+    int trace;              // Print every command to stderr (--trace)
+};
+
+// Why execute() returned
+typedef enum {
+    EXEC_DONE,   // Reached the end of the code
+    EXEC_LIMIT,  // Reached the instruction limit
+    EXEC_INPUT,  // Stopped before a ',' (stop_before_input, or no input available yet)
+    EXEC_TIMEOUT, // The time limit expired (checked where loops jump back)
+    EXEC_ERROR   // Runtime error (already reported)
+} ExecStatus;
+
+// Helper & compiler functions (implementations below); the public API is
+// declared in brainfuckpp.h
 int is_command_char(char c);
 char* filter_code(const char* input);
-int build_maps(Interpreter* interp);
-Interpreter* create_interpreter(const char* code_str, FILE* input, FILE* output);
-void free_interpreter(Interpreter* interp);
-int run(Interpreter* interp);
+char* filter_code_with_positions(const char* input, SourcePos** positions);
+int build_maps(Program* program);
+int fold_constant_output(Program* program);
+size_t mark_copy_loops(Program* program);
+int find_parallel_groups(Program* program);
+int compute_block_costs(Program* program);
+uint64_t hash_code(const char* code, size_t length);
+int load_cached_code(Program* program, const char* cache_dir);
+int store_cached_code(const Program* program, const char* cache_dir);
+char* encode_snapshot(const Machine* machine, const char* output, size_t output_length, size_t* size);
+int restore_snapshot(Machine* machine, const char* data, size_t size);
+void evaluate_prefix(Program* program, unsigned budget_ms);
+void reset_execution(Machine* machine);
+int flush_output(OutputBuffer* out);
 
 // --- Function Implementations ---
 
@@ -90,36 +342,57 @@ int is_command_char(char c) {
 
 // -- Pointer Method Implementations --
 
-int move_left(Pointer *self) {
-    // Ensure current node exists (should always exist after initialization)
-    if (!self->current) return -1; 
-    if (self->current->prev == NULL) {
+// Returns the node left of node, extending the tape if needed (NULL on failure)
+static inline Node* node_left(Node* node) {
+    if (node->prev == NULL) {
         Node* new_node = (Node*)malloc(sizeof(Node));
         if (new_node == NULL) {
-            perror("Failed to allocate memory in move_left"); return -1;
+            perror("Failed to allocate memory in move_left"); return NULL;
         }
         new_node->data = 0;
-        new_node->next = self->current;
+        new_node->next = node;
         new_node->prev = NULL;
-        self->current->prev = new_node;
+        node->prev = new_node;
     }
-    self->current = self->current->prev;
-    return 0;
+    return node->prev;
 }
 
-int move_right(Pointer *self) {
-    if (!self->current) return -1;
-    if (self->current->next == NULL) {
+// Returns the node right of node, extending the tape if needed (NULL on failure)
+static inline Node* node_right(Node* node) {
+    if (node->next == NULL) {
         Node* new_node = (Node*)malloc(sizeof(Node));
         if (new_node == NULL) {
-             perror("Failed to allocate memory in move_right"); return -1;
+             perror("Failed to allocate memory in move_right"); return NULL;
         }
         new_node->data = 0;
-        new_node->prev = self->current;
+        new_node->prev = node;
         new_node->next = NULL;
-        self->current->next = new_node;
+        node->next = new_node;
     }
-    self->current = self->current->next;
+    return node->next;
+}
+
+// Moves offset nodes from node (negative = left); NULL on failure
+static inline Node* node_relative(Node* node, int offset) {
+    for (; offset > 0 && node; offset--) node = node_right(node);
+    for (; offset < 0 && node; offset++) node = node_left(node);
+    return node;
+}
+
+int move_left(Pointer *self) {
+    // Ensure current node exists (should always exist after initialization)
+    if (!self->current) return -1; 
+    Node* node = node_left(self->current);
+    if (!node) return -1;
+    self->current = node;
+    return 0;
+}
+
+int move_right(Pointer *self) {
+    if (!self->current) return -1;
+    Node* node = node_right(self->current);
+    if (!node) return -1;
+    self->current = node;
     return 0;
 }
 
@@ -242,17 +515,559 @@ Pointer* create_temp_pointer(Pointer *self) {
     return temp_pointer;
 }
 
+// --- Lock-free Byte Rings ---
+
+static int ring_init(ByteRing* ring, size_t capacity) {
+    memset(ring, 0, sizeof(*ring));
+    ring->data = (unsigned char*)malloc(capacity);
+    ring->capacity = capacity;
+    return ring->data ? 0 : -1;
+}
+
+// Wakes the other side if it is asleep. Callers publish their change with a
+// sequentially consistent store first, so a side about to sleep either sees
+// the change or is counted in sleepers here.
+static void ring_wake(ByteRing* ring) {
+    if (atomic_load(&ring->sleepers) == 0) return;
+    atomic_fetch_add(&ring->wake_seq, 1);
+    syscall(SYS_futex, &ring->wake_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static int ring_ready(ByteRing* ring, int want_space) {
+    if (atomic_load(&ring->closed)) return 1;
+    size_t used = atomic_load(&ring->tail) - atomic_load(&ring->head);
+    return want_space ? used < ring->capacity : used > 0;
+}
+
+// Waits until the ring has space (or data), or is closed
+static void ring_wait(ByteRing* ring, int want_space) {
+    for (int i = 0; i < IO_RING_SPIN; i++) {
+        if (ring_ready(ring, want_space)) return;
+    }
+    atomic_fetch_add(&ring->sleepers, 1);
+    for (;;) {
+        uint32_t seq = atomic_load(&ring->wake_seq);
+        if (ring_ready(ring, want_space)) break;
+        syscall(SYS_futex, &ring->wake_seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+    }
+    atomic_fetch_sub(&ring->sleepers, 1);
+}
+
+// Producer: waits for free space and returns how much of it is contiguous
+// at *space, or 0 once the ring is closed
+static size_t ring_writable(ByteRing* ring, unsigned char** space) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t used;
+    while ((used = tail - atomic_load_explicit(&ring->head, memory_order_acquire)) == ring->capacity) {
+        if (atomic_load(&ring->closed)) return 0;
+        ring_wait(ring, 1);
+    }
+    if (atomic_load_explicit(&ring->closed, memory_order_relaxed)) return 0;
+    size_t offset = tail & (ring->capacity - 1);
+    size_t n = ring->capacity - used;
+    if (n > ring->capacity - offset) n = ring->capacity - offset;
+    *space = ring->data + offset;
+    return n;
+}
+
+// Producer: publishes n bytes written at the space from ring_writable
+static void ring_commit(ByteRing* ring, size_t n) {
+    atomic_fetch_add(&ring->tail, n);
+    ring_wake(ring);
+}
+
+// Consumer: waits for data and returns how much of it is contiguous at
+// *data, or 0 once the ring is closed and empty
+static size_t ring_readable(ByteRing* ring, const unsigned char** data) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t available;
+    while ((available = atomic_load_explicit(&ring->tail, memory_order_acquire) - head) == 0) {
+        if (atomic_load(&ring->closed)) {
+            // Bytes committed just before closing are still delivered
+            if (atomic_load(&ring->tail) == head) return 0;
+            continue;
+        }
+        ring_wait(ring, 0);
+    }
+    size_t offset = head & (ring->capacity - 1);
+    if (available > ring->capacity - offset) available = ring->capacity - offset;
+    *data = ring->data + offset;
+    return available;
+}
+
+// Consumer: releases n bytes returned by ring_readable
+static void ring_consume(ByteRing* ring, size_t n) {
+    atomic_fetch_add(&ring->head, n);
+    ring_wake(ring);
+}
+
+// Producer: waits until the consumer has released everything, or the ring
+// has closed. For the output ring that means all of it has been written.
+static void ring_drain(ByteRing* ring) {
+    atomic_fetch_add(&ring->sleepers, 1);
+    for (;;) {
+        uint32_t seq = atomic_load(&ring->wake_seq);
+        if (atomic_load(&ring->closed) || atomic_load(&ring->head) == atomic_load(&ring->tail)) break;
+        syscall(SYS_futex, &ring->wake_seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+    }
+    atomic_fetch_sub(&ring->sleepers, 1);
+}
+
+// Copies data into the ring, waiting for space. Returns -1 if it closed.
+static int ring_push(ByteRing* ring, const void* data, size_t length) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    while (length > 0) {
+        unsigned char* space;
+        size_t n = ring_writable(ring, &space);
+        if (n == 0) return -1;
+        if (n > length) n = length;
+        memcpy(space, bytes, n);
+        ring_commit(ring, n);
+        bytes += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// --- Output Buffering ---
+
+static int write_fd(void* context, const char* data, size_t length);
+
+static int output_init(OutputBuffer* out, const MachineIo* io, size_t capacity) {
+    out->data = (char*)malloc(capacity);
+    out->length = 0;
+    out->capacity = out->data ? capacity : 0;
+    out->write = io ? io->write : NULL;
+    out->context = io ? io->write_context : NULL;
+    out->fd = (out->write == write_fd) ? (int)(intptr_t)out->context : -1;
+    out->policy = (out->fd >= 0 && isatty(out->fd)) ? FLUSH_LINE : FLUSH_BLOCK;
+    out->flush_before_input = io ? io->interactive : 0;
+    out->failed = 0;
+    out->io = NULL;
+    return out->data ? 0 : -1;
+}
+
+static int write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// MachineIo callbacks for file descriptors (see fd_io)
+static int write_fd(void* context, const char* data, size_t length) {
+    return write_all((int)(intptr_t)context, data, length);
+}
+
+static long read_fd(void* context, unsigned char* buffer, size_t capacity) {
+    ssize_t n;
+    do {
+        n = read((int)(intptr_t)context, buffer, capacity);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return BFPP_WOULD_BLOCK;
+    return (long)n;
+}
+
+MachineIo fd_io(int input_fd, int output_fd) {
+    MachineIo io;
+    io.read = read_fd;
+    io.write = write_fd;
+    io.read_context = (void*)(intptr_t)input_fd;
+    io.write_context = (void*)(intptr_t)output_fd;
+    io.interactive = isatty(input_fd);
+    return io;
+}
+
+// Sends data to the destination of out; sets failed on error
+static void output_send(OutputBuffer* out, const char* data, size_t length) {
+    if (out->failed) return;
+    if (out->io) {
+        ring_push(&out->io->output, data, length);
+        out->failed = atomic_load_explicit(&out->io->write_failed, memory_order_relaxed);
+    } else if (out->write) {
+        out->failed = out->write(out->context, data, length) != 0;
+    }
+}
+
+// Writes out everything buffered. Returns -1 if output has failed.
+int flush_output(OutputBuffer* out) {
+    if (!out->write) return 0; // Capturing: keep everything
+    if (out->length > 0) output_send(out, out->data, out->length);
+    out->length = 0;
+    return out->failed ? -1 : 0;
+}
+
+// Makes room for at least n more bytes, by flushing or (when capturing) by
+// growing. Returns 0 if there is room afterwards.
+static int output_make_room(OutputBuffer* out, size_t n) {
+    if (out->write) {
+        flush_output(out);
+        return (n <= out->capacity) ? 0 : -1;
+    }
+    size_t capacity = out->capacity ? out->capacity * 2 : 4096;
+    while (capacity < out->length + n) capacity *= 2;
+    char* data = (char*)realloc(out->data, capacity);
+    if (!data) {
+        out->failed = 1;
+        out->length = 0;
+        return -1;
+    }
+    out->data = data;
+    out->capacity = capacity;
+    return 0;
+}
+
+static inline void output_byte(OutputBuffer* out, int value) {
+    if (out->length == out->capacity && output_make_room(out, 1) != 0) return;
+    out->data[out->length++] = (char)value;
+    if (out->policy != FLUSH_BLOCK
+        && (out->policy == FLUSH_INTERACTIVE || (char)value == '\n')) {
+        flush_output(out);
+    }
+}
+
+static void output_bytes(OutputBuffer* out, const char* data, size_t length) {
+    if (length > out->capacity - out->length && output_make_room(out, length) != 0) {
+        // Too large for the buffer even when empty: write it straight through
+        if (out->write) output_send(out, data, length);
+        return;
+    }
+    memcpy(out->data + out->length, data, length);
+    out->length += length;
+    if (out->policy == FLUSH_INTERACTIVE
+        || (out->policy == FLUSH_LINE && memchr(data, '\n', length))) {
+        flush_output(out);
+    }
+}
+
+// Like output_bytes, with shift added to every byte on the way
+static void output_shifted_bytes(OutputBuffer* out, const unsigned char* data, size_t length,
+                                 unsigned char shift) {
+    int newline = 0;
+    while (length > 0) {
+        if (out->length == out->capacity && output_make_room(out, 1) != 0) return;
+        size_t n = out->capacity - out->length;
+        if (n > length) n = length;
+        unsigned char* dest = (unsigned char*)out->data + out->length;
+        for (size_t k = 0; k < n; k++) dest[k] = (unsigned char)(data[k] + shift);
+        if (out->policy == FLUSH_LINE && !newline) newline = memchr(dest, '\n', n) != NULL;
+        out->length += n;
+        data += n;
+        length -= n;
+    }
+    if (out->policy == FLUSH_INTERACTIVE || newline) flush_output(out);
+}
+
+// Outputs value as a size-byte integer in native byte order (--io)
+static inline void output_cell(OutputBuffer* out, int value, size_t size) {
+    int32_t v32 = value;
+    int64_t v64 = value;
+    const void* bytes = (size == sizeof(v64)) ? (const void*)&v64 : (const void*)&v32;
+    if (out->capacity - out->length >= size) {
+        memcpy(out->data + out->length, bytes, size);
+        out->length += size;
+        if (out->policy == FLUSH_INTERACTIVE) flush_output(out);
+    } else {
+        output_bytes(out, (const char*)bytes, size);
+    }
+}
+
+void set_flush_policy(Machine* machine, FlushPolicy policy) {
+    machine->out.policy = policy;
+}
+
+// --- Input Buffering ---
+
+static int input_init(InputBuffer* in, const MachineIo* io) {
+    memset(in, 0, sizeof(*in));
+    in->read = io ? io->read : NULL;
+    in->context = io ? io->read_context : NULL;
+    in->fd = (in->read == read_fd) ? (int)(intptr_t)in->context : -1;
+    if (!in->read) {
+        in->eof = 1;
+        return 0;
+    }
+
+    struct stat st;
+    off_t offset = (in->fd >= 0) ? lseek(in->fd, 0, SEEK_CUR) : -1;
+    if (offset >= 0 && fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > offset) {
+        // mmap offsets must be page aligned; start mid-page if necessary
+        long page_size = sysconf(_SC_PAGESIZE);
+        off_t start = offset - offset % page_size;
+        size_t size = st.st_size - start;
+        void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, in->fd, start);
+        if (mapping != MAP_FAILED) {
+            madvise(mapping, size, MADV_SEQUENTIAL);
+            in->mapping = mapping;
+            in->mapping_size = size;
+            in->mapping_start = start;
+            in->pos = (const unsigned char*)mapping + (offset - start);
+            in->end = (const unsigned char*)mapping + size;
+            in->delivered = in->end - in->pos;
+            return 0;
+        }
+    }
+
+    in->buffer = (unsigned char*)malloc(INPUT_BUFFER_SIZE);
+    if (!in->buffer) return -1;
+    in->capacity = INPUT_BUFFER_SIZE;
+    in->pos = in->end = in->buffer;
+    return 0;
+}
+
+// Releases the input and leaves the descriptor's file offset just after the
+// last byte consumed, as if it had been read byte by byte.
+static void input_release(InputBuffer* in) {
+    if (in->mapping) {
+        lseek(in->fd, in->mapping_start + (in->pos - (const unsigned char*)in->mapping), SEEK_SET);
+        munmap(in->mapping, in->mapping_size);
+    } else if (in->fd >= 0 && in->end > in->pos && !in->io) {
+        lseek(in->fd, -(off_t)(in->end - in->pos), SEEK_CUR); // Fails harmlessly on pipes
+    }
+    free(in->buffer);
+    memset(in, 0, sizeof(*in));
+    in->fd = -1;
+}
+
+static int start_io_reader(IoThreads* io);
+
+// Refills the read buffer. Returns 0 if bytes are available afterwards,
+// INPUT_AGAIN if the source has none yet and -1 at the end of input.
+static int input_refill(InputBuffer* in) {
+    if (in->eof || in->mapping || !in->buffer) {
+        in->eof = 1;
+        return -1;
+    }
+    if (in->io && (in->io->reader_running || start_io_reader(in->io) == 0)) {
+        // Hand out the ring's bytes in place; they are released on the next refill
+        const unsigned char* data;
+        if (in->ring_held > 0) ring_consume(&in->io->input, in->ring_held);
+        in->ring_held = ring_readable(&in->io->input, &data);
+        if (in->ring_held == 0) {
+            in->eof = 1;
+            return -1;
+        }
+        in->pos = data;
+        in->end = data + in->ring_held;
+        in->delivered += in->ring_held;
+        return 0;
+    }
+    long n = in->read(in->context, in->buffer, in->capacity);
+    if (n == BFPP_WOULD_BLOCK) return INPUT_AGAIN;
+    if (n <= 0) {
+        in->eof = 1;
+        return -1;
+    }
+    in->pos = in->buffer;
+    in->end = in->buffer + n;
+    in->delivered += n;
+    return 0;
+}
+
+// Input bytes consumed since the machine started, including skipped ones
+static uint64_t input_consumed(const InputBuffer* in) {
+    return in->delivered - (uint64_t)(in->end - in->pos);
+}
+
+// Skips *count bytes as if ',' had read them, counting *count down. Skipping
+// past the end leaves the input at its end. Returns 0, or INPUT_AGAIN if the
+// source has nothing yet.
+static int input_skip(InputBuffer* in, uint64_t* count) {
+    while (*count > 0) {
+        if (in->pos == in->end) {
+            // A seekable descriptor skips without reading (fails on pipes)
+            if (in->buffer && !in->io && !in->eof && in->fd >= 0
+                && lseek(in->fd, (off_t)*count, SEEK_CUR) >= 0) {
+                in->delivered += *count;
+                *count = 0;
+                return 0;
+            }
+            int status = input_refill(in);
+            if (status == INPUT_AGAIN) return INPUT_AGAIN;
+            if (status != 0) return 0;
+        }
+        size_t n = in->end - in->pos;
+        if (n > *count) n = (size_t)*count;
+        in->pos += n;
+        *count -= n;
+    }
+    return 0;
+}
+
+// Returns the next input byte, EOF or INPUT_AGAIN
+static inline int input_byte(InputBuffer* in) {
+    if (in->pos == in->end) {
+        int status = input_refill(in);
+        if (status != 0) return (status == INPUT_AGAIN) ? INPUT_AGAIN : EOF;
+    }
+    return *in->pos++;
+}
+
+// Reads a size-byte integer in native byte order into *value (--io).
+// Returns EOF if the input ends first, including in the middle of a cell,
+// and INPUT_AGAIN if the rest of the cell has not arrived yet; the bytes
+// read so far are kept for the next call.
+static int input_cell(InputBuffer* in, int* value, size_t size) {
+    unsigned char* bytes = in->partial;
+    if (in->partial_length == 0 && (size_t)(in->end - in->pos) >= size) {
+        memcpy(bytes, in->pos, size);
+        in->pos += size;
+    } else {
+        while (in->partial_length < size) {
+            int c = input_byte(in);
+            if (c == INPUT_AGAIN) return INPUT_AGAIN;
+            if (c == EOF) {
+                in->partial_length = 0;
+                return EOF;
+            }
+            bytes[in->partial_length++] = (unsigned char)c;
+        }
+        in->partial_length = 0;
+    }
+    int32_t v32;
+    int64_t v64;
+    if (size == sizeof(v64)) {
+        memcpy(&v64, bytes, size);
+        *value = (int)v64; // Truncated to the cell width
+    } else {
+        memcpy(&v32, bytes, size);
+        *value = v32;
+    }
+    return 0;
+}
+
+// --- I/O Threads ---
+
+static void* io_writer_main(void* arg) {
+    IoThreads* io = (IoThreads*)arg;
+    const unsigned char* data;
+    size_t n;
+    while ((n = ring_readable(&io->output, &data)) > 0) {
+        // After a failure keep draining so that the interpreter never blocks
+        if (!atomic_load_explicit(&io->write_failed, memory_order_relaxed)
+            && write_all(io->out_fd, (const char*)data, n) != 0) {
+            atomic_store(&io->write_failed, 1);
+        }
+        ring_consume(&io->output, n);
+    }
+    return NULL;
+}
+
+static void* io_reader_main(void* arg) {
+    IoThreads* io = (IoThreads*)arg;
+    unsigned char* space;
+    size_t n;
+    while ((n = ring_writable(&io->input, &space)) > 0) {
+        // Block in poll rather than in read, so stop_io_threads can wake it
+        struct pollfd ready[2] = { { io->in_fd, POLLIN, 0 }, { io->wake_fd, POLLIN, 0 } };
+        if (poll(ready, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (ready[1].revents) break;
+        ssize_t got = read(io->in_fd, space, n);
+        // A non-blocking descriptor may still have nothing: poll again
+        if (got < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+        if (got <= 0) break;
+        ring_commit(&io->input, (size_t)got);
+    }
+    atomic_store(&io->input.closed, 1); // End of input
+    ring_wake(&io->input);
+    return NULL;
+}
+
+// Started lazily, so a program that never reads does not consume input
+// (e.g. a terminal's type-ahead) that belongs to whoever runs next
+static int start_io_reader(IoThreads* io) {
+    if (io->wake_fd < 0) io->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (io->wake_fd < 0 || pthread_create(&io->reader, NULL, io_reader_main, io) != 0) return -1;
+    io->reader_running = 1;
+    return 0;
+}
+
+// Moves output, and input that is not memory-mapped, onto background
+// threads connected to the interpreter by lock-free rings (--io-thread).
+// The flush policy still decides when buffered output enters the ring.
+// Returns 0 on success; on failure the interpreter keeps doing its own I/O.
+int start_io_threads(Machine* machine) {
+    IoThreads* io = (IoThreads*)calloc(1, sizeof(IoThreads));
+    if (!io) return -1;
+    io->wake_fd = -1;
+    io->out_fd = machine->out.fd;
+    io->in_fd = (machine->in.buffer && machine->in.fd >= 0) ? machine->in.fd : -1;
+    if ((io->out_fd >= 0 && ring_init(&io->output, IO_RING_SIZE) != 0)
+        || (io->in_fd >= 0 && ring_init(&io->input, IO_RING_SIZE) != 0)
+        || (io->out_fd >= 0 && pthread_create(&io->writer, NULL, io_writer_main, io) != 0)) {
+        free(io->output.data);
+        free(io->input.data);
+        free(io);
+        return -1;
+    }
+    io->writer_running = (io->out_fd >= 0);
+
+    flush_output(&machine->out);
+    if (io->out_fd >= 0) machine->out.io = io;
+    if (io->in_fd >= 0) machine->in.io = io;
+    machine->io = io;
+    return 0;
+}
+
+// Writes out everything left in the output ring and stops both threads
+static void stop_io_threads(IoThreads* io) {
+    if (io->writer_running) {
+        atomic_store(&io->output.closed, 1);
+        ring_wake(&io->output);
+        pthread_join(io->writer, NULL);
+    }
+    if (io->reader_running) {
+        // The closed flag wakes a reader waiting for ring space, the eventfd
+        // one waiting in poll for input
+        atomic_store(&io->input.closed, 1);
+        ring_wake(&io->input);
+        uint64_t one = 1;
+        while (write(io->wake_fd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+        pthread_join(io->reader, NULL);
+    }
+    if (io->wake_fd >= 0) close(io->wake_fd);
+    free(io->output.data);
+    free(io->input.data);
+    free(io);
+}
+
 // --- Interpreter Helper Functions ---
 
 // Filters code, removes comments and non-commands
 char* filter_code(const char* input) {
+    return filter_code_with_positions(input, NULL);
+}
+
+// Same as filter_code; if positions is non-NULL it also receives a malloc'd
+// array with the source line/column of every kept command.
+char* filter_code_with_positions(const char* input, SourcePos** positions) {
     size_t input_len = strlen(input);
     char* filtered = (char*)malloc(input_len + 1);
     if (!filtered) return NULL;
+    SourcePos* pos = NULL;
+    if (positions) {
+        pos = (SourcePos*)malloc(sizeof(SourcePos) * (input_len + 1));
+        if (!pos) { free(filtered); return NULL; }
+    }
 
     size_t j = 0;
     int in_comment = 0;
+    uint32_t line = 1, column = 0;
     for (size_t i = 0; i < input_len; i++) {
+        if (input[i] == '\n') {
+            line++; column = 0;
+        } else {
+            column++;
+        }
         if (in_comment) {
             if (input[i] == '\n') in_comment = 0;
             continue;
@@ -262,10 +1077,15 @@ char* filter_code(const char* input) {
             continue;
         }
         if (is_command_char(input[i])) {
+            if (pos) {
+                pos[j].line = line;
+                pos[j].column = column;
+            }
             filtered[j++] = input[i];
         }
     }
     filtered[j] = '\0';
+    if (positions) *positions = pos;
 
     // Shrink allocation (optional optimization)
     char* final_code = (char*)realloc(filtered, j + 1);
@@ -279,23 +1099,23 @@ typedef struct {
 } MapStackEntry;
 
 // Build jump maps for [] and ()
-int build_maps(Interpreter* interp) {
+int build_maps(Program* program) {
     MapStackEntry map_stack[MAX_NESTING_DEPTH];
     int stack_top = -1;
 
     // Initialize maps
-    interp->bracket_map = (int*)malloc(sizeof(int) * interp->code_length);
-    interp->paren_map = (int*)malloc(sizeof(int) * interp->code_length);
-    if (!interp->bracket_map || !interp->paren_map) {
+    program->bracket_map = (int*)malloc(sizeof(int) * program->code_length);
+    program->paren_map = (int*)malloc(sizeof(int) * program->code_length);
+    if (!program->bracket_map || !program->paren_map) {
         fprintf(stderr, "Error: Failed to allocate memory for jump maps.\n");
         return -1; // Indicate failure
     }
-    memset(interp->bracket_map, -1, sizeof(int) * interp->code_length);
-    memset(interp->paren_map, -1, sizeof(int) * interp->code_length);
+    memset(program->bracket_map, -1, sizeof(int) * program->code_length);
+    memset(program->paren_map, -1, sizeof(int) * program->code_length);
 
 
-    for (size_t i = 0; i < interp->code_length; i++) {
-        char c = interp->code[i];
+    for (size_t i = 0; i < program->code_length; i++) {
+        char c = program->code[i];
         size_t open_pos;
 
         switch (c) {
@@ -312,15 +1132,15 @@ int build_maps(Interpreter* interp) {
             case ']':
                 if (stack_top < 0 || map_stack[stack_top].type != TYPE_BRACKET) { /* Error */ return -1; }
                 open_pos = map_stack[stack_top].position;
-                interp->bracket_map[i] = open_pos;
-                interp->bracket_map[open_pos] = i;
+                program->bracket_map[i] = open_pos;
+                program->bracket_map[open_pos] = i;
                 stack_top--;
                 break;
             case ')':
                 if (stack_top < 0 || map_stack[stack_top].type != TYPE_PAREN) { /* Error */ return -1; }
                 open_pos = map_stack[stack_top].position;
-                interp->paren_map[i] = open_pos; // Store paren map too
-                interp->paren_map[open_pos] = i;
+                program->paren_map[i] = open_pos; // Store paren map too
+                program->paren_map[open_pos] = i;
                 stack_top--;
                 break;
         }
@@ -330,201 +1150,1605 @@ int build_maps(Interpreter* interp) {
     return 0; // Success
 }
 
-// --- Interpreter Lifecycle ---
+// --- Constant Output Folding ---
+//
+// Finds straight-line code ('+', '-', '<', '>', '.', '/') in which every '.'
+// prints a cell whose value is known at compile time, and replaces it with
+// OP_WRITE_LITERAL: one bulk write of the precomputed bytes followed by the
+// code's net effect on the tape. Cell values are known at the start of the
+// program (all zero) and right after a loop (the current cell is zero);
+// every other control transfer forgets what is known.
 
-Interpreter* create_interpreter(const char* code_str, FILE* input, FILE* output) {
-    Interpreter* interp = (Interpreter*)malloc(sizeof(Interpreter));
-    if (!interp) { perror("Failed malloc for Interpreter"); return NULL; }
+typedef struct {
+    uint32_t stamp;  // Entry is valid only while equal to the generation
+    int known;
+    int value;
+} KnownCell;
 
-    interp->input = input ? input : stdin;
-    interp->output = output ? output : stdout;
+typedef struct {
+    KnownCell* cells;     // Indexed by offset + bias
+    long bias;
+    uint32_t generation;
+    int default_zero;     // Cells without a valid entry hold 0
+} CellKnowledge;
 
-    // Filter code
-    interp->code = filter_code(code_str);
-    if (!interp->code) { free(interp); return NULL; }
-    interp->code_length = strlen(interp->code);
-    if (interp->code_length > MAX_CODE_SIZE) {
-        fprintf(stderr, "Error: Code exceeds maximum size.\n");
-        free(interp->code); free(interp); return NULL;
+static void forget_cells(CellKnowledge* k, int default_zero) {
+    k->generation++;
+    k->default_zero = default_zero;
+}
+
+static int lookup_cell(const CellKnowledge* k, long offset, int* value) {
+    const KnownCell* cell = &k->cells[offset + k->bias];
+    if (cell->stamp != k->generation) {
+        *value = 0;
+        return k->default_zero;
     }
+    *value = cell->value;
+    return cell->known;
+}
 
-    // Create main pointer (this also creates the initial tape node)
-    interp->main_pointer = create_pointer();
-    if (!interp->main_pointer) {
-         free(interp->code); free(interp); return NULL;
+static void set_cell(CellKnowledge* k, long offset, int known, int value) {
+    KnownCell* cell = &k->cells[offset + k->bias];
+    cell->stamp = k->generation;
+    cell->known = known;
+    cell->value = value;
+}
+
+// Computes the byte printed by every '.' whose cell value is known at
+// compile time, or -1, into dot_value
+static void find_constant_output(const Program* program, CellKnowledge* k, int* dot_value) {
+    long saved[MAX_NESTING_DEPTH]; // Pointer offsets at open '(' (LONG_MIN: unknown)
+    int saved_top = -1;
+    long offset = 0;
+    int value;
+
+    forget_cells(k, 1);
+    for (size_t i = 0; i < program->code_length; i++) {
+        dot_value[i] = -1;
+        switch (program->code[i]) {
+            case '+':
+            case '-':
+                if (lookup_cell(k, offset, &value)) {
+                    // Wrap like the interpreter's int arithmetic, without UB
+                    unsigned int v = (unsigned int)value + (program->code[i] == '+' ? 1u : -1u);
+                    set_cell(k, offset, 1, (int)v);
+                }
+                break;
+            case '>': offset++; break;
+            case '<': offset--; break;
+            case '.':
+                if (lookup_cell(k, offset, &value)) dot_value[i] = (unsigned char)value;
+                break;
+            case ',':
+                set_cell(k, offset, 0, 0);
+                break;
+            case '(':
+                saved[++saved_top] = offset;
+                break;
+            case ')':
+                if (saved_top >= 0 && saved[saved_top] != LONG_MIN) {
+                    offset = saved[saved_top];
+                } else {
+                    forget_cells(k, 0);
+                    offset = 0;
+                }
+                if (saved_top >= 0) saved_top--;
+                break;
+            case '[':
+            case ']':
+            case '*':
+                // The pointer may end up anywhere relative to where it was
+                forget_cells(k, 0);
+                offset = 0;
+                for (int j = 0; j <= saved_top; j++) saved[j] = LONG_MIN;
+                if (program->code[i] == ']') set_cell(k, 0, 1, 0); // Loops exit on zero
+                break;
+        }
     }
+}
 
-    // Initialize pointer stack (-1 means only main_pointer is active)
-    interp->pointer_stack_top = -1;
+int fold_constant_output(Program* program) {
+    size_t n = program->code_length;
+    if (n == 0) return 0;
 
-    // Build maps
-    interp->bracket_map = NULL; // Initialize map pointers
-    interp->paren_map = NULL;
-    if (build_maps(interp) != 0) {
-        fprintf(stderr, "Error: Mismatched brackets or parentheses in code.\n");
-        free_pointer_tape(interp->main_pointer); // Free tape nodes
-        free(interp->main_pointer); // Free pointer struct
-        free(interp->code);
-        free(interp->bracket_map); // build_maps allocates them
-        free(interp->paren_map);
-        free(interp);
-        return NULL;
+    CellKnowledge k = { NULL, (long)n, 0, 1 };
+    int* dot_value = (int*)malloc(sizeof(int) * n);
+    int* deltas = (int*)calloc(2 * n + 1, sizeof(int)); // Scratch, by offset + n
+    k.cells = (KnownCell*)calloc(2 * n + 1, sizeof(KnownCell));
+    size_t op_capacity = 0, bytes_capacity = 0, delta_capacity = 0;
+    int status = -1;
+    if (!dot_value || !deltas || !k.cells) goto done;
+
+    find_constant_output(program, &k, dot_value);
+
+    size_t start = 0;  // Start of the current candidate range
+    long last_dot = -1; // Last constant '.' in the candidate
+    for (size_t i = 0; i <= n; i++) {
+        char c = (i < n) ? program->code[i] : '\0';
+        int constant_dot = (c == '.' && dot_value[i] >= 0);
+        if (constant_dot) last_dot = i;
+        if (constant_dot || (c != '\0' && strchr("+-<>/", c))) continue;
+
+        // The candidate ends here; fold it up to its last constant '.'
+        size_t end = last_dot + 1;
+        if (last_dot >= 0 && end - start >= 2) {
+            if (program->literal_op_count == op_capacity) {
+                op_capacity = op_capacity ? op_capacity * 2 : 16;
+                LiteralOp* ops = (LiteralOp*)realloc(program->literal_ops, sizeof(LiteralOp) * op_capacity);
+                if (!ops) goto done;
+                program->literal_ops = ops;
+            }
+            LiteralOp* op = &program->literal_ops[program->literal_op_count];
+            op->end = end;
+            op->original = program->code[start];
+            op->output_offset = program->literal_bytes_length;
+            op->delta_offset = program->literal_delta_count;
+
+            long offset = 0, min_offset = 0, max_offset = 0;
+            for (size_t j = start; j < end; j++) {
+                switch (program->code[j]) {
+                    case '+': deltas[offset + n]++; break;
+                    case '-': deltas[offset + n]--; break;
+                    case '>': offset++; break;
+                    case '<': offset--; break;
+                    case '.':
+                        if (program->literal_bytes_length == bytes_capacity) {
+                            bytes_capacity = bytes_capacity ? bytes_capacity * 2 : 256;
+                            char* bytes = (char*)realloc(program->literal_bytes, bytes_capacity);
+                            if (!bytes) goto done;
+                            program->literal_bytes = bytes;
+                        }
+                        program->literal_bytes[program->literal_bytes_length++] = (char)dot_value[j];
+                        break;
+                }
+                if (offset < min_offset) min_offset = offset;
+                if (offset > max_offset) max_offset = offset;
+            }
+            for (long o = min_offset; o <= max_offset; o++) {
+                if (deltas[o + n] == 0) continue;
+                if (program->literal_delta_count == delta_capacity) {
+                    delta_capacity = delta_capacity ? delta_capacity * 2 : 64;
+                    CellDelta* d = (CellDelta*)realloc(program->literal_deltas, sizeof(CellDelta) * delta_capacity);
+                    if (!d) goto done;
+                    program->literal_deltas = d;
+                }
+                program->literal_deltas[program->literal_delta_count].offset = (int32_t)o;
+                program->literal_deltas[program->literal_delta_count].delta = deltas[o + n];
+                program->literal_delta_count++;
+                deltas[o + n] = 0;
+            }
+            op->output_length = program->literal_bytes_length - op->output_offset;
+            op->delta_count = program->literal_delta_count - op->delta_offset;
+            op->move = (int32_t)offset;
+            program->bracket_map[start] = (int)program->literal_op_count++;
+            program->code[start] = OP_WRITE_LITERAL;
+        }
+        start = i + 1;
+        last_dot = -1;
     }
 
-    return interp;
+    status = 0;
+
+done:
+    free(dot_value);
+    free(deltas);
+    free(k.cells);
+    return status;
 }
 
-void free_interpreter(Interpreter* interp) {
-    if (!interp) return;
+// --- Copy Loops ---
+//
+// A loop of the form [A.B,] where A and B are runs of '+'/'-' prints the
+// current cell plus A, and then every input byte plus A, until it reads a
+// 0 byte or the end of input. OP_COPY_LOOP runs it over whole input blocks
+// with memchr and a byte-wise add instead of command by command.
 
-    // Free the linked list tape via the main pointer
-    free_pointer_tape(interp->main_pointer);
-    // Free the main pointer struct itself
-    free(interp->main_pointer);
+static int is_copy_loop(const char* code, size_t open, size_t close) {
+    size_t i = open + 1;
+    while (i < close && (code[i] == '+' || code[i] == '-')) i++;
+    if (i >= close || code[i++] != '.') return 0;
+    while (i < close && (code[i] == '+' || code[i] == '-')) i++;
+    return i + 1 == close && code[i] == ',';
+}
+
+static inline int is_loop_open(char c) {
+    return c == '[' || c == OP_COPY_LOOP;
+}
 
-    // Free any temporary pointers left on the stack (shouldn't happen with correct code)
-    for(int i = 0; i <= interp->pointer_stack_top; ++i) {
-        // Don't free the tape again, just the pointer struct
-        free(interp->pointer_stack[i]);
+// Replaces the '[' of every copy loop with OP_COPY_LOOP; returns how many
+size_t mark_copy_loops(Program* program) {
+    size_t count = 0;
+    for (size_t i = 0; i < program->code_length; i++) {
+        if (program->code[i] == '[' && is_copy_loop(program->code, i, program->bracket_map[i])) {
+            program->code[i] = OP_COPY_LOOP;
+            count++;
+        }
     }
+    return count;
+}
+
+// --- Time Limits ---
+//
+// A time limit is a one-shot POSIX timer that sets a flag when it expires.
+// The engines read the flag only where a loop jumps back, which costs one
+// load per iteration and nothing per command. The timer notifies on a
+// thread of its own that may still be running after the timer is deleted,
+// so the flag lives in a Deadline that the timer and its owner share and
+// the last one to let go frees.
 
-    // Free code buffer and maps
-    free(interp->code);
-    free(interp->bracket_map);
-    free(interp->paren_map);
+struct Deadline {
+    atomic_int expired;
+    atomic_int refs;
+    timer_t timer;
+};
+
+static atomic_int no_deadline; // Never set: the flag read without a time limit
 
-    // Free the interpreter struct itself
-    free(interp);
+static void release_deadline(Deadline* deadline) {
+    if (atomic_fetch_sub(&deadline->refs, 1) == 1) free(deadline);
 }
 
+static void deadline_expired(union sigval value) {
+    Deadline* deadline = (Deadline*)value.sival_ptr;
+    atomic_store(&deadline->expired, 1);
+    release_deadline(deadline);
+}
 
-// --- Main Execution Logic ---
+// Starts a timer that expires after ms milliseconds. Returns NULL if it
+// cannot be created.
+static Deadline* arm_deadline(unsigned ms) {
+    Deadline* deadline = (Deadline*)calloc(1, sizeof(Deadline));
+    if (!deadline) return NULL;
+    atomic_init(&deadline->refs, 2); // The owner and the timer
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD;
+    event.sigev_notify_function = deadline_expired;
+    event.sigev_value.sival_ptr = deadline;
+    if (timer_create(CLOCK_MONOTONIC, &event, &deadline->timer) != 0) {
+        free(deadline);
+        return NULL;
+    }
+    struct itimerspec when = { { 0, 0 }, { ms / 1000, (long)(ms % 1000) * 1000000 } };
+    if (timer_settime(deadline->timer, 0, &when, NULL) != 0) {
+        timer_delete(deadline->timer);
+        free(deadline);
+        return NULL;
+    }
+    return deadline;
+}
 
-int run(Interpreter* interp) {
-    size_t ip = 0;
-    Pointer* current_active_pointer = interp->main_pointer; // Use a clear name
+static void disarm_deadline(Deadline* deadline) {
+    struct itimerspec stop = { { 0, 0 }, { 0, 0 } }, left;
+    // Stopped before it expired: the timer will never notify
+    int unexpired = timer_settime(deadline->timer, 0, &stop, &left) == 0
+        && (left.it_value.tv_sec != 0 || left.it_value.tv_nsec != 0);
+    timer_delete(deadline->timer);
+    if (unexpired) release_deadline(deadline);
+    release_deadline(deadline);
+}
 
-    const size_t MAX_INSTRUCTIONS = 100000000;
-    size_t instruction_count = 0;
-    int debug_enabled = 0; // 禁用调试
+// The flag a machine's engines check, whether or not it has a time limit
+static const atomic_int* deadline_flag(const Deadline* deadline) {
+    return deadline ? &deadline->expired : &no_deadline;
+}
 
-    while (ip < interp->code_length && instruction_count < MAX_INSTRUCTIONS) {
-        char command = interp->code[ip];
-        instruction_count++;
+// --- Parallel Regions ---
+//
+// With CompileOptions.parallel_regions (--parallel-regions), consecutive
+// () regions that provably touch disjoint cells run on worker threads. A
+// region qualifies when it does no I/O, has no '*' and every loop in it
+// returns the pointer to where the loop started, so the cells it can reach
+// are known at compile time. At run time the group's cells are created up
+// front, so the regions never change the tape's links, and saved; if a
+// region would exceed the instruction budget they are restored and the
+// group runs sequentially instead, which stops at the exact instruction.
 
-        if (debug_enabled) {
-            int cell_value = get_value(current_active_pointer);
-            fprintf(stderr, "[指令:%zu 命令:'%c' 堆栈级别:%d 当前值:%d(%c)] ", 
-                ip, command, interp->pointer_stack_top, 
-                cell_value, isprint(cell_value) ? cell_value : '.');
-        }
+#define PARALLEL_MIN_WORK (1 << 16)   // Estimated commands off the main thread for a group to pay off
+#define PARALLEL_MAX_CELLS (1 << 16)  // Largest group, in cells (they are saved on every run)
+#define PARALLEL_MAX_REGIONS 64
+#define PARALLEL_LOOP_WEIGHT 256      // Assumed iterations per loop when estimating work
 
-        switch (command) {
-            case '>': {
-                if (current_active_pointer->move_right(current_active_pointer) != 0) {
-                    fprintf(stderr, "Runtime Error: move_right failed at ip %zu\n", ip);
-                    return -1;
-                }
-                if (debug_enabled) fprintf(stderr, " -> NewVal: %d\n", get_value(current_active_pointer)); 
+// Checks that the region opening at open qualifies and describes it
+static int analyze_region(const Program* program, size_t open, ParallelRegion* region) {
+    const char* code = program->code;
+    size_t close = program->paren_map[open];
+    int32_t offset = 0, lo = 0, hi = 0;
+    int32_t starts[MAX_NESTING_DEPTH]; // Offset at each open '[' or '('
+    int open_count = 0;
+    uint32_t depth = 1, max_depth = 1;
+    uint64_t work = 2, weight = 1;
+    for (size_t i = open + 1; i < close; i++) {
+        switch (code[i]) {
+            case '>': offset++; break;
+            case '<': offset--; break;
+            case '+': case '-': case '/': break;
+            case '[':
+                starts[open_count++] = offset;
+                if (weight < ((uint64_t)1 << 40)) weight *= PARALLEL_LOOP_WEIGHT;
                 break;
-            }
-            case '<': {
-                if (current_active_pointer->move_left(current_active_pointer) != 0) {
-                     fprintf(stderr, "Runtime Error: move_left failed at ip %zu\n", ip);
-                    return -1;
-                }
-                 if (debug_enabled) fprintf(stderr, " -> NewVal: %d\n", get_value(current_active_pointer)); 
+            case ']':
+                if (starts[--open_count] != offset) return 0; // Loop moves the pointer
+                if (weight > 1) weight /= PARALLEL_LOOP_WEIGHT;
+                break;
+            case '(':
+                starts[open_count++] = offset;
+                if (++depth > max_depth) max_depth = depth;
+                break;
+            case ')':
+                offset = starts[--open_count];
+                depth--;
+                break;
+            default:
+                return 0; // I/O, '*' and the internal ops
+        }
+        if (offset < lo) lo = offset;
+        if (offset > hi) hi = offset;
+        work += weight;
+    }
+    region->open = (uint32_t)open;
+    region->close = (uint32_t)close;
+    region->base = 0;
+    region->lo = lo;
+    region->hi = hi;
+    region->depth = max_depth;
+    region->work = work;
+    return 1;
+}
+
+// Finds the groups worth running in parallel. Returns -1 on allocation
+// failure, which leaves everything sequential.
+int find_parallel_groups(Program* program) {
+    const char* code = program->code;
+    size_t length = program->code_length;
+    program->parallel_group_at = (int*)malloc((length + 1) * sizeof(int));
+    if (!program->parallel_group_at) return -1;
+    for (size_t i = 0; i < length; i++) program->parallel_group_at[i] = -1;
+
+    size_t group_capacity = 0, region_capacity = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (code[i] != '(') continue;
+        ParallelRegion regions[PARALLEL_MAX_REGIONS];
+        ParallelGroup group = { 0 };
+        size_t count = 0, pos = i;
+        int32_t base = 0;
+        uint32_t between = 0;
+        while (count < PARALLEL_MAX_REGIONS && pos < length && code[pos] == '('
+               && analyze_region(program, pos, &regions[count])) {
+            ParallelRegion* region = &regions[count];
+            region->base = base;
+            int32_t lo = base + region->lo, hi = base + region->hi;
+            int disjoint = 1;
+            for (size_t k = 0; k < count && disjoint; k++) {
+                disjoint = hi < regions[k].base + regions[k].lo || lo > regions[k].base + regions[k].hi;
+            }
+            if (count > 0 && group.lo < lo) lo = group.lo;
+            if (count > 0 && group.hi > hi) hi = group.hi;
+            if (!disjoint || (int64_t)hi - lo >= PARALLEL_MAX_CELLS) break;
+
+            group.lo = lo;
+            group.hi = hi;
+            group.move = base;
+            group.between = between;
+            if (region->depth > group.depth) group.depth = region->depth;
+            group.end = region->close + 1;
+            count++;
+            for (pos = region->close + 1; pos < length && (code[pos] == '<' || code[pos] == '>'); pos++) {
+                base += (code[pos] == '>') ? 1 : -1;
+                between++;
+            }
+        }
+
+        // Worth it only if enough work leaves the thread that runs the largest region
+        uint64_t total = 0, largest = 0;
+        for (size_t k = 0; k < count; k++) {
+            total += regions[k].work;
+            if (regions[k].work > largest) largest = regions[k].work;
+        }
+        if (count < 2 || total - largest < PARALLEL_MIN_WORK) continue;
+
+        if (program->parallel_group_count == group_capacity) {
+            group_capacity = group_capacity ? group_capacity * 2 : 16;
+            ParallelGroup* grown = (ParallelGroup*)realloc(program->parallel_groups,
+                                                           group_capacity * sizeof(ParallelGroup));
+            if (!grown) return -1;
+            program->parallel_groups = grown;
+        }
+        if (program->parallel_region_count + count > region_capacity) {
+            region_capacity = (program->parallel_region_count + count) * 2;
+            ParallelRegion* grown = (ParallelRegion*)realloc(program->parallel_regions,
+                                                             region_capacity * sizeof(ParallelRegion));
+            if (!grown) return -1;
+            program->parallel_regions = grown;
+        }
+        group.first_region = (uint32_t)program->parallel_region_count;
+        group.region_count = (uint32_t)count;
+        memcpy(program->parallel_regions + program->parallel_region_count, regions,
+               count * sizeof(ParallelRegion));
+        program->parallel_region_count += count;
+        program->parallel_group_at[i] = (int)program->parallel_group_count;
+        program->parallel_groups[program->parallel_group_count++] = group;
+        i = group.end - 1; // Regions inside a group are not grouped again
+    }
+    return 0;
+}
+
+typedef struct {
+    const Program* program;
+    const ParallelRegion* region;
+    Node* cell;              // Cell at the region's '('
+    size_t budget;           // Instructions it may run
+    size_t count;            // Instructions it ran
+    const atomic_int* time_up; // The machine's time limit expired
+    int ok;                  // 0 if it ran out of budget or time
+} RegionJob;
+
+struct RegionPool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;     // Jobs were posted (or shutdown)
+    pthread_cond_t done;     // All posted jobs are finished
+    RegionJob* jobs;
+    size_t job_count, next_job, finished;
+    int shutdown;
+    unsigned thread_count;
+    pthread_t threads[];
+};
+
+// Runs a region from its '(' through its ')'. Only the commands that
+// analyze_region admits can occur, and every cell it reaches exists.
+static void run_region_job(RegionJob* job) {
+    const Program* program = job->program;
+    const char* code = program->code;
+    Node* saved[MAX_NESTING_DEPTH];
+    int top = -1;
+    Node* cell = job->cell;
+    size_t count = 0;
+    job->ok = 0;
+    for (size_t ip = job->region->open; ip <= job->region->close; ip++) {
+        if (++count > job->budget) return;
+        switch (code[ip]) {
+            case '+': cell->data++; break;
+            case '-': cell->data--; break;
+            case '>': cell = cell->next; break;
+            case '<': cell = cell->prev; break;
+            case '[': if (cell->data == 0) ip = program->bracket_map[ip]; break;
+            case ']':
+                if (cell->data != 0) {
+                    if (atomic_load_explicit(job->time_up, memory_order_relaxed)) return;
+                    ip = program->bracket_map[ip];
+                }
+                break;
+            case '(': saved[++top] = cell; break;
+            case ')': cell = saved[top--]; break;
+        }
+    }
+    job->count = count;
+    job->ok = 1;
+}
+
+static void* region_worker_main(void* arg) {
+    RegionPool* pool = (RegionPool*)arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->shutdown && pool->next_job >= pool->job_count) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->shutdown) break;
+        RegionJob* job = &pool->jobs[pool->next_job++];
+        pthread_mutex_unlock(&pool->lock);
+        run_region_job(job);
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->finished == pool->job_count) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// The machine's own thread works too, so thread_count threads are started
+// next to it. Threads that fail to start just leave more work to the rest.
+static RegionPool* start_region_pool(unsigned thread_count) {
+    RegionPool* pool = (RegionPool*)calloc(1, sizeof(RegionPool) + thread_count * sizeof(pthread_t));
+    if (!pool) return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    while (pool->thread_count < thread_count
+           && pthread_create(&pool->threads[pool->thread_count], NULL, region_worker_main, pool) == 0) {
+        pool->thread_count++;
+    }
+    return pool;
+}
+
+static void stop_region_pool(RegionPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (unsigned t = 0; t < pool->thread_count; t++) pthread_join(pool->threads[t], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool);
+}
+
+// Runs jobs on the pool and the calling thread, and waits for all of them
+static void run_region_jobs(RegionPool* pool, RegionJob* jobs, size_t count) {
+    pthread_mutex_lock(&pool->lock);
+    pool->jobs = jobs;
+    pool->job_count = count;
+    pool->next_job = 0;
+    pool->finished = 0;
+    pthread_cond_broadcast(&pool->work);
+    while (pool->next_job < pool->job_count) {
+        RegionJob* job = &pool->jobs[pool->next_job++];
+        pthread_mutex_unlock(&pool->lock);
+        run_region_job(job);
+        pthread_mutex_lock(&pool->lock);
+        pool->finished++;
+    }
+    while (pool->finished < pool->job_count) pthread_cond_wait(&pool->done, &pool->lock);
+    pool->jobs = NULL;
+    pool->job_count = pool->next_job = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Runs group, whose first '(' is at cell, within budget instructions
+// (counting that '('). Returns 0 and the instructions used, or -1 with the
+// tape unchanged if it has to run sequentially.
+static int run_parallel_group(Machine* machine, const ParallelGroup* group, Node* cell,
+                              size_t budget, size_t* used) {
+    const Program* program = machine->program;
+    if (machine->profile_counts) return -1; // Counts are per command, kept sequentially
+    // Sequential execution would overflow the pointer stack inside
+    if (machine->pointer_stack_top + (int)group->depth >= MAX_POINTER_STACK_DEPTH) return -1;
+    if (!machine->region_pool) {
+        machine->region_pool = start_region_pool(program->parallel_threads - 1);
+        if (!machine->region_pool) return -1;
+    }
+
+    // Create every cell the group reaches, so the regions never allocate
+    Node* first = node_relative(cell, group->lo);
+    if (!first || !node_relative(cell, group->hi)) return -1;
+    size_t cells = (size_t)(group->hi - group->lo) + 1;
+    int* saved = (int*)malloc(cells * sizeof(int));
+    if (!saved) return -1;
+    Node* node = first;
+    for (size_t k = 0; k < cells; k++, node = node->next) saved[k] = node->data;
+
+    RegionJob jobs[PARALLEL_MAX_REGIONS];
+    const ParallelRegion* regions = program->parallel_regions + group->first_region;
+    for (uint32_t r = 0; r < group->region_count; r++) {
+        jobs[r].program = program;
+        jobs[r].region = &regions[r];
+        jobs[r].cell = node_relative(cell, regions[r].base);
+        jobs[r].budget = budget;
+        jobs[r].time_up = deadline_flag(machine->deadline);
+    }
+    run_region_jobs(machine->region_pool, jobs, group->region_count);
+
+    size_t total = group->between;
+    int ok = 1;
+    for (uint32_t r = 0; r < group->region_count; r++) {
+        ok = ok && jobs[r].ok;
+        total += jobs[r].count;
+    }
+    if (!ok || total > budget) {
+        // The instruction limit falls inside the group: undo it
+        node = first;
+        for (size_t k = 0; k < cells; k++, node = node->next) node->data = saved[k];
+        free(saved);
+        return -1;
+    }
+    free(saved);
+    *used = total;
+    return 0;
+}
+
+// --- Compiled Code Cache ---
+//
+// A cache entry holds everything create_interpreter derives from the source
+// (optimized code, both jump maps and the literal tables) in a flat, 8-byte
+// aligned layout, so a
+// later run can mmap the file and point the interpreter straight into it.
+// Entries are named after a hash of the filtered code and BFPP_VERSION.
+// The entry also carries a snapshot of the execution state after the
+// input-independent prefix of the program has been run (see evaluate_prefix).
+
+typedef struct {
+    char magic[8];
+    uint32_t format_version;
+    uint32_t header_size;
+    char compiler_version[16];
+    uint64_t code_hash;
+    uint64_t code_length;
+    uint64_t code_offset;
+    uint64_t bracket_map_offset;
+    uint64_t paren_map_offset;
+    uint64_t literal_op_offset;
+    uint64_t literal_op_count;
+    uint64_t literal_bytes_offset;
+    uint64_t literal_bytes_length;
+    uint64_t literal_delta_offset;
+    uint64_t literal_delta_count;
+    uint64_t snapshot_offset;
+    uint64_t snapshot_size;
+    uint64_t file_size;
+} CacheHeader;
+
+#define CACHE_ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+
+// FNV-1a over the filtered code, seeded with the compiler version
+uint64_t hash_code(const char* code, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    const char* version = BFPP_VERSION;
+    for (size_t i = 0; version[i]; i++) {
+        hash ^= (unsigned char)version[i];
+        hash *= 1099511628211ULL;
+    }
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)code[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void cache_path(char* buf, size_t size, const char* cache_dir, uint64_t hash) {
+    snprintf(buf, size, "%s/%016llx%s", cache_dir, (unsigned long long)hash, CACHE_FILE_SUFFIX);
+}
+
+static int check_snapshot(const char* data, size_t size, size_t code_length);
+
+// Checks that position i of a cached jump map pairs the bracket code[i]
+// with its counterpart, and that the counterpart points back. The engine
+// follows the maps without bounds checks.
+static int cached_jump_matches(const int* map, const char* code, size_t length, size_t i,
+                               char open, char close) {
+    char c = code[i];
+    if (c != open && c != close) return 1;
+    int64_t j = map[i];
+    if (j < 0 || (uint64_t)j >= length || map[j] != (int64_t)i) return 0;
+    return (c == open) ? (j > (int64_t)i && code[j] == close) : (j < (int64_t)i && code[j] == open);
+}
+
+// Checks that the optimized code in a cache entry was compiled from code,
+// i.e. that it matches once internal commands are replaced by the commands
+// they stand for, and that every literal op and jump is well formed.
+static int cached_code_matches(const CacheHeader* header, const char* mapping, const char* code) {
+    const char* cached = mapping + header->code_offset;
+    const int* bracket_map = (const int*)(mapping + header->bracket_map_offset);
+    const int* paren_map = (const int*)(mapping + header->paren_map_offset);
+    const LiteralOp* ops = (const LiteralOp*)(mapping + header->literal_op_offset);
+    for (size_t i = 0; i < header->code_length; i++) {
+        char c = cached[i];
+        if (c == OP_WRITE_LITERAL) {
+            if (bracket_map[i] < 0 || (uint64_t)bracket_map[i] >= header->literal_op_count) return 0;
+            const LiteralOp* op = &ops[bracket_map[i]];
+            if (op->end <= i || op->end > header->code_length
+                || (uint64_t)op->output_offset + op->output_length > header->literal_bytes_length
+                || (uint64_t)op->delta_offset + op->delta_count > header->literal_delta_count) {
+                return 0;
+            }
+            c = op->original;
+        } else if (c == OP_COPY_LOOP) {
+            if (bracket_map[i] <= (int64_t)i || (uint64_t)bracket_map[i] >= header->code_length
+                || !is_copy_loop(code, i, bracket_map[i])) {
+                return 0;
+            }
+            c = '[';
+        }
+        if (c != code[i]) return 0;
+        if (!cached_jump_matches(bracket_map, code, header->code_length, i, '[', ']')
+            || !cached_jump_matches(paren_map, code, header->code_length, i, '(', ')')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Maps a cache entry for program->code. On a hit, replaces program->code with
+// the copy inside the mapping and sets up the jump maps, literal tables and
+// snapshot; returns 0. Returns -1 on a miss or on any mismatch, leaving
+// program untouched.
+int load_cached_code(Program* program, const char* cache_dir) {
+    char path[4096];
+    uint64_t hash = program->code_hash;
+    cache_path(path, sizeof(path), cache_dir, hash);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+        close(fd); return -1;
+    }
+    void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return -1;
+
+    const CacheHeader* header = (const CacheHeader*)mapping;
+    uint64_t map_bytes = sizeof(int) * program->code_length;
+    int valid = memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) == 0
+        && header->format_version == CACHE_FORMAT_VERSION
+        && header->header_size == sizeof(CacheHeader)
+        && strncmp(header->compiler_version, BFPP_VERSION, sizeof(header->compiler_version)) == 0
+        && header->code_hash == hash
+        && header->code_length == program->code_length
+        && header->file_size == (uint64_t)st.st_size
+        && header->code_offset + program->code_length + 1 <= header->file_size
+        && header->bracket_map_offset + map_bytes <= header->file_size
+        && header->paren_map_offset + map_bytes <= header->file_size
+        && header->literal_op_offset + sizeof(LiteralOp) * header->literal_op_count <= header->file_size
+        && header->literal_bytes_offset + header->literal_bytes_length <= header->file_size
+        && header->literal_delta_offset + sizeof(CellDelta) * header->literal_delta_count <= header->file_size
+        && header->snapshot_offset + header->snapshot_size <= header->file_size;
+    // Guard against hash collisions: the stored code must match exactly
+    if (valid) {
+        valid = cached_code_matches(header, (const char*)mapping, program->code);
+    }
+    if (valid && header->snapshot_size > 0) {
+        valid = check_snapshot((const char*)mapping + header->snapshot_offset,
+                               header->snapshot_size, program->code_length) == 0;
+    }
+    if (!valid) {
+        munmap(mapping, st.st_size);
+        return -1;
+    }
+
+    free(program->code);
+    program->code = (char*)mapping + header->code_offset;
+    program->bracket_map = (int*)((char*)mapping + header->bracket_map_offset);
+    program->paren_map = (int*)((char*)mapping + header->paren_map_offset);
+    program->literal_ops = (LiteralOp*)((char*)mapping + header->literal_op_offset);
+    program->literal_op_count = header->literal_op_count;
+    program->literal_bytes = (char*)mapping + header->literal_bytes_offset;
+    program->literal_bytes_length = header->literal_bytes_length;
+    program->literal_deltas = (CellDelta*)((char*)mapping + header->literal_delta_offset);
+    program->literal_delta_count = header->literal_delta_count;
+    // Machines reference the snapshot's pending output inside the mapping
+    program->snapshot = header->snapshot_size > 0 ? (const char*)mapping + header->snapshot_offset : NULL;
+    program->snapshot_size = header->snapshot_size;
+    program->cache_mapping = mapping;
+    program->cache_mapping_size = st.st_size;
+    return 0;
+}
+
+// Writes the compiled form of program to the cache. The entry is written to a
+// temporary file and renamed into place so concurrent runs never observe a
+// partially written artifact. Returns 0 on success, -1 on failure.
+int store_cached_code(const Program* program, const char* cache_dir) {
+    size_t snapshot_size = program->snapshot_size;
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.format_version = CACHE_FORMAT_VERSION;
+    header.header_size = sizeof(CacheHeader);
+    strncpy(header.compiler_version, BFPP_VERSION, sizeof(header.compiler_version) - 1);
+    header.code_hash = program->code_hash;
+    header.code_length = program->code_length;
+    header.code_offset = CACHE_ALIGN(sizeof(CacheHeader));
+    header.bracket_map_offset = CACHE_ALIGN(header.code_offset + program->code_length + 1);
+    header.paren_map_offset = CACHE_ALIGN(header.bracket_map_offset + sizeof(int) * program->code_length);
+    header.literal_op_offset = CACHE_ALIGN(header.paren_map_offset + sizeof(int) * program->code_length);
+    header.literal_op_count = program->literal_op_count;
+    header.literal_bytes_offset = CACHE_ALIGN(header.literal_op_offset + sizeof(LiteralOp) * program->literal_op_count);
+    header.literal_bytes_length = program->literal_bytes_length;
+    header.literal_delta_offset = CACHE_ALIGN(header.literal_bytes_offset + program->literal_bytes_length);
+    header.literal_delta_count = program->literal_delta_count;
+    header.snapshot_offset = CACHE_ALIGN(header.literal_delta_offset + sizeof(CellDelta) * program->literal_delta_count);
+    header.snapshot_size = snapshot_size;
+    header.file_size = header.snapshot_offset + snapshot_size;
+
+    char* image = (char*)calloc(1, header.file_size);
+    if (!image) return -1;
+    memcpy(image, &header, sizeof(header));
+    memcpy(image + header.code_offset, program->code, program->code_length + 1);
+    memcpy(image + header.bracket_map_offset, program->bracket_map, sizeof(int) * program->code_length);
+    memcpy(image + header.paren_map_offset, program->paren_map, sizeof(int) * program->code_length);
+    if (program->literal_op_count > 0) {
+        memcpy(image + header.literal_op_offset, program->literal_ops, sizeof(LiteralOp) * program->literal_op_count);
+        memcpy(image + header.literal_bytes_offset, program->literal_bytes, program->literal_bytes_length);
+    }
+    if (program->literal_delta_count > 0) {
+        memcpy(image + header.literal_delta_offset, program->literal_deltas, sizeof(CellDelta) * program->literal_delta_count);
+    }
+    if (snapshot_size > 0) memcpy(image + header.snapshot_offset, program->snapshot, snapshot_size);
+
+    char path[4096], tmp_path[4096 + 32];
+    cache_path(path, sizeof(path), cache_dir, header.code_hash);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%ld", path, (long)getpid());
+
+    mkdir(cache_dir, 0755); // Ignore EEXIST; open() below reports real problems
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { free(image); return -1; }
+    int write_status = write_all(fd, image, header.file_size);
+    free(image);
+    if (close(fd) != 0 || write_status != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// --- Execution Snapshots ---
+//
+// A snapshot captures the execution state (tape contents, pointer positions,
+// ip, instruction count and the output produced so far) in a flat buffer:
+// a SnapshotHeader, the pointer offsets, the tape runs, the cells of those
+// runs and the output, each section 8-byte aligned so the buffer can be used
+// in place from a mapping. Stretches of at least SNAPSHOT_MIN_GAP zero cells
+// between runs are not stored, so a sparse tape stays small.
+
+typedef struct {
+    uint64_t ip;
+    uint64_t instruction_count;
+    uint64_t tape_length;    // Cells from the leftmost to the rightmost
+    uint64_t run_count;      // Stored runs of cells, left to right; the rest are 0
+    uint64_t stored_cells;   // Cells in all runs together
+    uint64_t pointer_count;  // Pointer stack bottom-up, then the active pointer
+    uint64_t output_length;  // Output produced before ip
+} SnapshotHeader;
+
+// Cells [start, start + length) of the tape, stored one after another
+typedef struct {
+    uint64_t start;
+    uint64_t length;
+} SnapshotRun;
+
+// Where the sections of a snapshot start
+typedef struct {
+    size_t offsets_at;
+    size_t runs_at;
+    size_t cells_at;
+    size_t output_at;
+    size_t size;
+} SnapshotLayout;
+
+static SnapshotLayout snapshot_layout(const SnapshotHeader* header) {
+    SnapshotLayout layout;
+    layout.offsets_at = CACHE_ALIGN(sizeof(SnapshotHeader));
+    layout.runs_at = CACHE_ALIGN(layout.offsets_at + sizeof(int64_t) * header->pointer_count);
+    layout.cells_at = CACHE_ALIGN(layout.runs_at + sizeof(SnapshotRun) * header->run_count);
+    layout.output_at = CACHE_ALIGN(layout.cells_at + sizeof(int) * header->stored_cells);
+    layout.size = layout.output_at + header->output_length;
+    return layout;
+}
+
+// Finds the runs of cells to store, starting at the leftmost cell, and fills
+// runs unless it is NULL. Returns the number of runs and adds their cells
+// to *stored.
+static size_t find_snapshot_runs(const Node* leftmost, SnapshotRun* runs, uint64_t* stored) {
+    size_t count = 0;
+    uint64_t index = 0, start = 0, run_end = 0; // run_end: past the run's last non-zero cell
+    for (const Node* node = leftmost; node; node = node->next, index++) {
+        if (node->data == 0) continue;
+        if (count == 0 || index - run_end >= SNAPSHOT_MIN_GAP) {
+            if (count > 0) *stored += run_end - start;
+            start = index;
+            count++;
+        }
+        run_end = index + 1;
+        if (runs) {
+            runs[count - 1].start = start;
+            runs[count - 1].length = run_end - start;
+        }
+    }
+    if (count > 0) *stored += run_end - start;
+    return count;
+}
+
+// Returns a malloc'd snapshot of machine's current state, with output as
+// the output produced so far, or NULL
+char* encode_snapshot(const Machine* machine, const char* output, size_t output_length, size_t* size) {
+    size_t pointer_count = machine->pointer_stack_top + 2;
+    Node* pointers[MAX_POINTER_STACK_DEPTH + 1];
+    for (int i = 0; i <= machine->pointer_stack_top; i++) {
+        pointers[i] = machine->pointer_stack[i]->current;
+    }
+    pointers[pointer_count - 1] = machine->active_pointer->current;
+
+    Node* leftmost = machine->main_pointer->current;
+    while (leftmost->prev) leftmost = leftmost->prev;
+    SnapshotHeader counts;
+    memset(&counts, 0, sizeof(counts));
+    for (Node* node = leftmost; node; node = node->next) counts.tape_length++;
+    counts.run_count = find_snapshot_runs(leftmost, NULL, &counts.stored_cells);
+    counts.pointer_count = pointer_count;
+    counts.output_length = output_length;
+    SnapshotLayout layout = snapshot_layout(&counts);
+    *size = layout.size;
+
+    char* data = (char*)calloc(1, *size);
+    if (!data) return NULL;
+    SnapshotHeader* header = (SnapshotHeader*)data;
+    *header = counts;
+    header->ip = machine->ip;
+    header->instruction_count = machine->instruction_count;
+
+    int64_t* offsets = (int64_t*)(data + layout.offsets_at);
+    SnapshotRun* runs = (SnapshotRun*)(data + layout.runs_at);
+    int* cells = (int*)(data + layout.cells_at);
+    uint64_t stored = 0;
+    find_snapshot_runs(leftmost, runs, &stored);
+    int64_t index = 0;
+    size_t run = 0;
+    for (Node* node = leftmost; node; node = node->next, index++) {
+        for (size_t i = 0; i < pointer_count; i++) {
+            if (pointers[i] == node) offsets[i] = index;
+        }
+        if (run < counts.run_count && (uint64_t)index >= runs[run].start) {
+            *cells++ = node->data;
+            if ((uint64_t)index + 1 == runs[run].start + runs[run].length) run++;
+        }
+    }
+    if (output_length > 0) memcpy(data + layout.output_at, output, output_length);
+    return data;
+}
+
+// Returns 0 if data is a well-formed snapshot for code of code_length
+static int check_snapshot(const char* data, size_t size, size_t code_length) {
+    if (size < sizeof(SnapshotHeader)) return -1;
+    const SnapshotHeader* header = (const SnapshotHeader*)data;
+    if (header->ip > code_length || header->tape_length == 0
+        || header->run_count > size || header->stored_cells > size
+        || header->pointer_count == 0 || header->pointer_count > MAX_POINTER_STACK_DEPTH + 1
+        || header->output_length > size) {
+        return -1;
+    }
+    SnapshotLayout layout = snapshot_layout(header);
+    if (layout.size > size) return -1;
+    const int64_t* offsets = (const int64_t*)(data + layout.offsets_at);
+    for (size_t i = 0; i < header->pointer_count; i++) {
+        if (offsets[i] < 0 || (uint64_t)offsets[i] >= header->tape_length) return -1;
+    }
+    const SnapshotRun* runs = (const SnapshotRun*)(data + layout.runs_at);
+    uint64_t next = 0, stored = 0; // Runs are in order and don't overlap
+    for (size_t k = 0; k < header->run_count; k++) {
+        if (runs[k].start < next || runs[k].start >= header->tape_length || runs[k].length == 0
+            || runs[k].length > header->tape_length - runs[k].start) {
+            return -1;
+        }
+        next = runs[k].start + runs[k].length;
+        stored += runs[k].length;
+    }
+    return (stored == header->stored_cells) ? 0 : -1;
+}
+
+// Replaces machine's execution state with a snapshot. The pending output is
+// referenced in place, so data must outlive the machine's use of it.
+// Returns -1 (leaving machine untouched) if the snapshot is malformed.
+int restore_snapshot(Machine* machine, const char* data, size_t size) {
+    if (check_snapshot(data, size, machine->program->code_length) != 0) return -1;
+    const SnapshotHeader* header = (const SnapshotHeader*)data;
+    SnapshotLayout layout = snapshot_layout(header);
+    const int64_t* offsets = (const int64_t*)(data + layout.offsets_at);
+    const SnapshotRun* runs = (const SnapshotRun*)(data + layout.runs_at);
+    const int* cells = (const int*)(data + layout.cells_at);
+
+    // Build the new tape before touching machine, so failure leaves it intact
+    Node** nodes = (Node**)malloc(sizeof(Node*) * header->tape_length);
+    Pointer* temps[MAX_POINTER_STACK_DEPTH + 1];
+    size_t temp_count = header->pointer_count - 1;
+    size_t built = 0, temps_built = 0;
+    if (!nodes) return -1;
+    for (; built < header->tape_length; built++) {
+        nodes[built] = (Node*)malloc(sizeof(Node));
+        if (!nodes[built]) break;
+        nodes[built]->data = 0;
+        nodes[built]->prev = built > 0 ? nodes[built - 1] : NULL;
+        nodes[built]->next = NULL;
+        if (built > 0) nodes[built - 1]->next = nodes[built];
+    }
+    for (; built == header->tape_length && temps_built < temp_count; temps_built++) {
+        temps[temps_built] = create_temp_pointer(machine->main_pointer);
+        if (!temps[temps_built]) break;
+    }
+    if (built < header->tape_length || temps_built < temp_count) {
+        for (size_t i = 0; i < built; i++) free(nodes[i]);
+        for (size_t i = 0; i < temps_built; i++) free(temps[i]);
+        free(nodes);
+        return -1;
+    }
+    for (size_t k = 0; k < header->run_count; k++) {
+        for (uint64_t i = 0; i < runs[k].length; i++) nodes[runs[k].start + i]->data = *cells++;
+    }
+
+    reset_execution(machine);
+    free_pointer_tape(machine->main_pointer);
+    machine->main_pointer->current = nodes[offsets[0]];
+    for (size_t i = 0; i < temp_count; i++) {
+        temps[i]->current = nodes[offsets[i + 1]];
+    }
+    // Stack bottom is always the main pointer; the active pointer is the last entry
+    machine->pointer_stack_top = (int)header->pointer_count - 2;
+    for (int i = 0; i <= machine->pointer_stack_top; i++) {
+        machine->pointer_stack[i] = (i == 0) ? machine->main_pointer : temps[i - 1];
+    }
+    machine->active_pointer = (temp_count > 0) ? temps[temp_count - 1] : machine->main_pointer;
+    machine->ip = header->ip;
+    machine->instruction_count = header->instruction_count;
+    machine->pending_output = data + layout.output_at;
+    machine->pending_output_length = header->output_length;
+    free(nodes);
+    return 0;
+}
+
+static ExecStatus execute(Machine* machine, size_t instruction_limit, int stop_before_input);
+
+static unsigned long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Runs the part of the program that does not depend on input, up to the
+// first ',' or until budget_ms has elapsed, and keeps the resulting state
+// and its output as the snapshot every machine starts from. If the prefix
+// fails at run time, nothing is kept so the error is reported by the real
+// run instead.
+void evaluate_prefix(Program* program, unsigned budget_ms) {
+    Machine* machine = create_machine(program, NULL); // No input, output captured
+    if (!machine) return;
+    machine->suppress_errors = 1;
+    unsigned long start = monotonic_ms();
+    ExecStatus status;
+    do {
+        size_t limit = machine->instruction_count + PREFIX_EVAL_CHUNK;
+        if (limit > MAX_INSTRUCTIONS) limit = MAX_INSTRUCTIONS;
+        status = execute(machine, limit, 1);
+    } while (status == EXEC_LIMIT && machine->instruction_count < MAX_INSTRUCTIONS
+             && machine->out.length < PREFIX_EVAL_MAX_OUTPUT
+             && monotonic_ms() - start < budget_ms);
+
+    if (status != EXEC_ERROR && !machine->out.failed) {
+        program->owned_snapshot = encode_snapshot(machine, machine->out.data, machine->out.length,
+                                                  &program->snapshot_size);
+        program->snapshot = program->owned_snapshot;
+        if (!program->snapshot) program->snapshot_size = 0;
+    }
+    free_machine(machine);
+}
+
+// --- Program and Machine Lifecycle ---
+
+// Frees everything compile_program allocated for program
+void free_program(Program* program) {
+    if (!program) return;
+    // Free code buffer and maps (or the cache mapping that holds them)
+    if (program->cache_mapping) {
+        munmap(program->cache_mapping, program->cache_mapping_size);
+    } else {
+        free(program->code);
+        free(program->bracket_map);
+        free(program->paren_map);
+        free(program->literal_ops);
+        free(program->literal_bytes);
+        free(program->literal_deltas);
+    }
+    free(program->owned_snapshot);
+    free(program->parallel_group_at);
+    free(program->parallel_groups);
+    free(program->parallel_regions);
+    free(program->block_cost);
+    free(program);
+}
+
+// options may be NULL to always compile from source
+Program* compile_program(const char* source, const CompileOptions* options) {
+    Program* program = (Program*)calloc(1, sizeof(Program));
+    if (!program) { perror("Failed malloc for Program"); return NULL; }
+    const char* cache_dir = options ? options->cache_dir : NULL;
+    program->io_cell_size = (options && options->io_cell_size) ? options->io_cell_size : 1;
+
+    // Filter code
+    program->code = filter_code(source);
+    if (!program->code) { free(program); return NULL; }
+    program->code_length = strlen(program->code);
+    program->code_hash = hash_code(program->code, program->code_length);
+    if (program->io_cell_size != 1) {
+        // Compiled differently (nothing is folded into bytes), so cached apart
+        program->code_hash = (program->code_hash ^ program->io_cell_size) * 1099511628211ULL;
+    }
+    if (program->code_length > MAX_CODE_SIZE) {
+        fprintf(stderr, "Error: Code exceeds maximum size.\n");
+        free_program(program);
+        return NULL;
+    }
+
+    program->parallel_threads = options ? options->parallel_regions : 0;
+
+    if (cache_dir && load_cached_code(program, cache_dir) == 0) {
+        // Cache hit: code and maps live in the mapping
+        if (program->parallel_threads > 1) find_parallel_groups(program);
+        if (compute_block_costs(program) != 0) {
+            fprintf(stderr, "Error: Failed to allocate block costs.\n");
+            free_program(program);
+            return NULL;
+        }
+        return program;
+    }
+    if (build_maps(program) != 0) {
+        fprintf(stderr, "Error: Mismatched brackets or parentheses in code.\n");
+        free_program(program); // build_maps allocates the maps even on failure
+        return NULL;
+    }
+    // Optimization is best effort; a failure leaves correct (if slower) code.
+    // Both optimizations below produce and consume bytes.
+    if (program->io_cell_size == 1) {
+        fold_constant_output(program);
+        mark_copy_loops(program);
+    }
+    if (program->parallel_threads > 1) find_parallel_groups(program);
+    if (compute_block_costs(program) != 0) {
+        fprintf(stderr, "Error: Failed to allocate block costs.\n");
+        free_program(program);
+        return NULL;
+    }
+    if (cache_dir && options->prefix_budget_ms > 0) {
+        evaluate_prefix(program, options->prefix_budget_ms);
+    }
+    if (cache_dir && store_cached_code(program, cache_dir) != 0) {
+        fprintf(stderr, "Warning: Failed to write compiled code cache in '%s'.\n", cache_dir);
+    }
+
+    return program;
+}
+
+// io may be NULL: no input, and output is kept in memory
+Machine* create_machine(const Program* program, const MachineIo* io) {
+    Machine* machine = (Machine*)calloc(1, sizeof(Machine));
+    if (!machine) { perror("Failed malloc for Machine"); return NULL; }
+    machine->program = program;
+    machine->instruction_limit = MAX_INSTRUCTIONS;
+
+    if (output_init(&machine->out, io, OUTPUT_BUFFER_SIZE) != 0) {
+        fprintf(stderr, "Error: Failed to allocate output buffer.\n");
+        free(machine); return NULL;
+    }
+    if (input_init(&machine->in, io) != 0) {
+        fprintf(stderr, "Error: Failed to allocate input buffer.\n");
+        free(machine->out.data); free(machine); return NULL;
+    }
+
+    // Create main pointer (this also creates the initial tape node)
+    machine->main_pointer = create_pointer();
+    if (!machine->main_pointer) {
+        input_release(&machine->in); free(machine->out.data); free(machine); return NULL;
+    }
+
+    // Initialize pointer stack (-1 means only main_pointer is active)
+    machine->pointer_stack_top = -1;
+    machine->active_pointer = machine->main_pointer;
+
+    if (program->snapshot && restore_snapshot(machine, program->snapshot, program->snapshot_size) != 0) {
+        fprintf(stderr, "Error: Failed to restore the program's initial state.\n");
+        free_machine(machine);
+        return NULL;
+    }
+    machine->at_prefix_snapshot = (program->snapshot != NULL);
+    return machine;
+}
+
+const char* captured_output(const Machine* machine, size_t* length) {
+    *length = machine->out.write ? 0 : machine->out.length;
+    return machine->out.data;
+}
+
+// Frees temporary pointers created by '(' that are still alive. The bottom
+// of the pointer stack is always main_pointer, which is owned separately.
+static void release_temp_pointers(Machine* machine) {
+    if (machine->active_pointer != machine->main_pointer) {
+        free(machine->active_pointer);
+    }
+    for (int i = 1; i <= machine->pointer_stack_top; ++i) {
+        free(machine->pointer_stack[i]);
+    }
+    machine->pointer_stack_top = -1;
+    machine->active_pointer = machine->main_pointer;
+}
+
+// Returns machine to the state before its first instruction: a single zero
+// cell, no temporary pointers and no pending output.
+void reset_execution(Machine* machine) {
+    release_temp_pointers(machine);
+    free_pointer_tape(machine->main_pointer);
+    init_pointer(machine->main_pointer); // On allocation failure current stays NULL
+    machine->ip = 0;
+    machine->instruction_count = 0;
+    machine->pending_output = NULL;
+    machine->pending_output_length = 0;
+}
+
+void free_machine(Machine* machine) {
+    if (!machine) return;
+
+    // Free any temporary pointers left on the stack (execution stopped inside ())
+    release_temp_pointers(machine);
+
+    // Free the linked list tape via the main pointer
+    free_pointer_tape(machine->main_pointer);
+    // Free the main pointer struct itself
+    free(machine->main_pointer);
+
+    free(machine->source_map);
+    free(machine->profile_counts);
+    input_release(&machine->in);
+    if (machine->io) stop_io_threads(machine->io);
+    if (machine->region_pool) stop_region_pool(machine->region_pool);
+    free(machine->out.data);
+
+    // Free the machine struct itself
+    free(machine);
+}
+
+
+// --- Main Execution Logic ---
+
+// Reports a runtime error unless errors are suppressed
+static void runtime_error(const Machine* machine, const char* format, ...) {
+    if (machine->suppress_errors) return;
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+// A block runs from any position through the next command that may jump
+// ('[', ']', a copy loop or a parallel group), or the end of the code.
+// Commands inside a block always run one after another, so execute charges
+// the instruction budget for a whole block at once instead of per command.
+int compute_block_costs(Program* program) {
+    size_t length = program->code_length;
+    program->block_cost = (uint32_t*)malloc((length + 1) * sizeof(uint32_t));
+    if (!program->block_cost) return -1;
+    uint32_t cost = 0;
+    program->block_cost[length] = 0;
+    for (size_t i = length; i-- > 0; ) {
+        char c = program->code[i];
+        int jumps = c == '[' || c == ']' || c == OP_COPY_LOOP
+            || (c == '(' && program->parallel_group_at && program->parallel_group_at[i] >= 0);
+        cost = jumps ? 1 : cost + 1;
+        program->block_cost[i] = cost;
+    }
+    return 0;
+}
+
+// Cells are unbounded, and isprint is only defined for unsigned char values
+static int printable_cell(int value) {
+    return value >= 0 && value <= UCHAR_MAX && isprint(value);
+}
+
+// Prints one command of --trace before it runs
+static void trace_command(const Machine* machine, size_t ip, char command, const Node* cell) {
+    int cell_value = cell->data;
+    fprintf(stderr, "[指令:%zu 命令:'%c' 堆栈级别:%d 当前值:%d(%c)] ",
+        ip, command, machine->pointer_stack_top,
+        cell_value, printable_cell(cell_value) ? cell_value : '.');
+}
+
+// The execution engine. It is instantiated once per combination of the
+// constant trace/profile arguments (see execute below), so the fast path
+// carries no debugging or profiling code at all.
+// Executes from the saved state until the code ends, instruction_count
+// reaches instruction_limit, or (with stop_before_input) a ',' is next.
+// The state is saved back on return, so execution can be resumed.
+static inline __attribute__((always_inline))
+ExecStatus execute_engine(Machine* machine, size_t instruction_limit, int stop_before_input,
+                          const int trace, const int profile) {
+    const Program* program = machine->program;
+    size_t* const profile_counts = profile ? machine->profile_counts : NULL;
+    size_t ip = machine->ip;
+    Pointer* current_active_pointer = machine->active_pointer; // Use a clear name
+    // The active pointer's cell is kept in a local for the whole run, so
+    // cell accesses don't go through the Pointer struct and its function
+    // pointers. It is written back to the Pointer only where the pointer
+    // itself escapes: when '(' pushes it and when execution stops.
+    Node* cell = current_active_pointer->current;
+    ExecStatus status = EXEC_DONE;
+    const atomic_int* time_up = deadline_flag(machine->deadline);
+
+    // instruction_count is charged a block ahead: it already includes every
+    // command before block_end. Commands that don't run (an error or ','
+    // stops execution) are taken back at stop, so the count is exact there.
+    size_t instruction_count = machine->instruction_count;
+    size_t block_end;
+
+next_block:
+    block_end = ip; // Nothing is charged ahead yet
+    if (ip >= program->code_length) goto stop;
+    size_t budget = (instruction_count < instruction_limit) ? instruction_limit - instruction_count : 0;
+    if (budget == 0) { status = EXEC_LIMIT; goto stop; }
+    // When the limit falls inside the block, run only the commands it allows
+    if (budget > program->block_cost[ip]) budget = program->block_cost[ip];
+    instruction_count += budget;
+    block_end = ip + budget;
+
+    while (ip < block_end) {
+        char command = program->code[ip];
+        if (profile_counts) profile_counts[ip]++;
+
+        if (trace) {
+            // Trace the source commands rather than the fused ones
+            if (command == OP_WRITE_LITERAL) command = program->literal_ops[program->bracket_map[ip]].original;
+            else if (command == OP_COPY_LOOP) command = '[';
+            trace_command(machine, ip, command, cell);
+        }
+
+    dispatch:
+        switch (command) {
+            case OP_WRITE_LITERAL: {
+                const LiteralOp* op = &program->literal_ops[program->bracket_map[ip]];
+                if (op->end > block_end) {
+                    // Not enough budget left for all of it: run it command by command
+                    command = op->original;
+                    goto dispatch;
+                }
+                output_bytes(&machine->out, program->literal_bytes + op->output_offset, op->output_length);
+                if (machine->out.failed) { status = EXEC_ERROR; goto stop; }
+                const CellDelta* deltas = program->literal_deltas + op->delta_offset;
+                int32_t at = 0;
+                Node* target = cell;
+                for (uint32_t k = 0; k < op->delta_count && target; k++) {
+                    target = node_relative(target, deltas[k].offset - at);
+                    at = deltas[k].offset;
+                    if (target) target->data += deltas[k].delta;
+                }
+                if (target) target = node_relative(target, op->move - at);
+                if (!target) {
+                    runtime_error(machine, "Runtime Error: tape allocation failed at ip %zu\n", ip);
+                    status = EXEC_ERROR; goto stop;
+                }
+                cell = target;
+                if (profile_counts) {
+                    for (size_t k = ip + 1; k < op->end; k++) profile_counts[k]++;
+                }
+                ip = op->end - 1; // Already charged: literals lie inside one block
+                break;
+            }
+            case OP_COPY_LOOP: {
+                size_t close = program->bracket_map[ip];
+                size_t per_iteration = close - ip; // Body plus ']'
+                if (cell->data == 0 || stop_before_input
+                    || instruction_count + per_iteration > instruction_limit) {
+                    command = '[';
+                    goto dispatch;
+                }
+                unsigned add = 0;
+                for (size_t k = ip + 1; program->code[k] != '.'; k++) {
+                    add += (program->code[k] == '+') ? 1u : -1u;
+                }
+                // Iteration i prints the byte read by iteration i - 1, the
+                // first one prints the cell. Only whole iterations are run.
+                size_t affordable = (instruction_limit - instruction_count) / per_iteration;
+                size_t iterations = 0;
+                int last = 0; // Byte read by the last iteration
+                unsigned printed = (unsigned)cell->data; // Value the last '.' printed, before add
+                output_byte(&machine->out, (int)(printed + add));
+                InputBuffer* in = &machine->in;
+                for (;;) {
+                    if (machine->out.failed) break;
+                    // A filter may never reach its ']': check the time limit
+                    // before every refill and chunk instead
+                    if (atomic_load_explicit(time_up, memory_order_relaxed)) {
+                        status = EXEC_TIMEOUT;
+                        goto copy_loop_suspend;
+                    }
+                    if (in->pos == in->end) {
+                        if (machine->out.flush_before_input) flush_output(&machine->out);
+                        int refill = input_refill(in);
+                        if (refill == INPUT_AGAIN) {
+                            status = EXEC_INPUT;
+                            goto copy_loop_suspend;
+                        }
+                        if (refill != 0) {
+                            iterations++; // Reads 0 at the end of input
+                            last = 0;
+                            break;
+                        }
+                    }
+                    size_t n = in->end - in->pos;
+                    if (n > INPUT_BUFFER_SIZE) n = INPUT_BUFFER_SIZE; // Mapped input comes in one piece
+                    if (n > affordable - iterations) n = affordable - iterations;
+                    const unsigned char* zero = (const unsigned char*)memchr(in->pos, 0, n);
+                    if (zero) {
+                        output_shifted_bytes(&machine->out, in->pos, zero - in->pos, (unsigned char)add);
+                        iterations += zero - in->pos + 1;
+                        in->pos = zero + 1;
+                        last = 0;
+                        break;
+                    }
+                    iterations += n;
+                    if (iterations == affordable) {
+                        // Out of budget: the last byte read is not printed yet
+                        output_shifted_bytes(&machine->out, in->pos, n - 1, (unsigned char)add);
+                        last = in->pos[n - 1];
+                        in->pos += n;
+                        break;
+                    }
+                    output_shifted_bytes(&machine->out, in->pos, n, (unsigned char)add);
+                    printed = in->pos[n - 1];
+                    in->pos += n;
+                }
+                if (machine->out.failed) { status = EXEC_ERROR; goto stop; }
+                cell->data = last;
+                if (profile_counts) {
+                    for (size_t k = ip + 1; k <= close; k++) profile_counts[k] += iterations;
+                }
+                instruction_count += iterations * per_iteration;
+                if (last == 0) ip = close; // Otherwise resume at the start of the body
+                ip++;
+                goto next_block;
+
+            copy_loop_suspend: {
+                // No input yet or out of time: stop inside the current
+                // iteration, whose '.' has run, just before its ','
+                size_t comma = ip + 1;
+                while (program->code[comma] != '.') comma++;
+                unsigned add_after = 0;
+                for (comma++; program->code[comma] != ','; comma++) {
+                    add_after += (program->code[comma] == '+') ? 1u : -1u;
+                }
+                cell->data = (int)(printed + add + add_after);
+                if (profile_counts) {
+                    for (size_t k = ip + 1; k <= close; k++) {
+                        profile_counts[k] += iterations + (k < comma);
+                    }
+                }
+                instruction_count += iterations * per_iteration + (comma - ip - 1);
+                ip = block_end = comma; // Counted exactly already
+                goto stop;
+            }
+            }
+            case '>': {
+                Node* next = node_right(cell);
+                if (!next) {
+                    runtime_error(machine, "Runtime Error: move_right failed at ip %zu\n", ip);
+                    status = EXEC_ERROR; goto stop;
+                }
+                cell = next;
+                if (trace) fprintf(stderr, " -> NewVal: %d\n", cell->data); 
+                break;
+            }
+            case '<': {
+                Node* prev = node_left(cell);
+                if (!prev) {
+                     runtime_error(machine, "Runtime Error: move_left failed at ip %zu\n", ip);
+                    status = EXEC_ERROR; goto stop;
+                }
+                cell = prev;
+                 if (trace) fprintf(stderr, " -> NewVal: %d\n", cell->data); 
                 break;
             }
             case '+': {
-                int old_val = get_value(current_active_pointer);
-                current_active_pointer->increment_value(current_active_pointer);
-                if (debug_enabled) fprintf(stderr, " Val:%d -> %d\n", old_val, get_value(current_active_pointer));
+                int old_val = cell->data;
+                cell->data++;
+                if (trace) fprintf(stderr, " Val:%d -> %d\n", old_val, cell->data);
                 break;
             }
             case '-': {
-                 int old_val = get_value(current_active_pointer);
-                 current_active_pointer->decrement_value(current_active_pointer);
-                 if (debug_enabled) fprintf(stderr, " Val:%d -> %d\n", old_val, get_value(current_active_pointer));
+                 int old_val = cell->data;
+                 cell->data--;
+                 if (trace) fprintf(stderr, " Val:%d -> %d\n", old_val, cell->data);
                  break;
             }
             case '.': {
-                 int val_to_output = get_value(current_active_pointer);
-                 if (debug_enabled) fprintf(stderr, " Outputting Val:%d ('%c')\n", val_to_output, isprint(val_to_output)?val_to_output:'?');
-                 fputc(val_to_output, interp->output);
+                 int val_to_output = cell->data;
+                 if (trace) fprintf(stderr, " Outputting Val:%d ('%c')\n", val_to_output, printable_cell(val_to_output)?val_to_output:'?');
+                 if (program->io_cell_size == 1) output_byte(&machine->out, val_to_output);
+                 else output_cell(&machine->out, val_to_output, program->io_cell_size);
+                 // The output is gone (e.g. a closed pipe): stop, as SIGPIPE would
+                 if (machine->out.failed) { status = EXEC_ERROR; goto stop; }
                  break;
             }
             case ',': {
-                int input_char = fgetc(interp->input);
-                int old_val = get_value(current_active_pointer);
+                if (stop_before_input) {
+                    // Undo the accounting for the ',' that does not run now
+                    if (profile_counts) profile_counts[ip]--;
+                    status = EXEC_INPUT; goto stop;
+                }
+                if (machine->out.flush_before_input) flush_output(&machine->out);
+                int input_char;
+                if (program->io_cell_size == 1) {
+                    input_char = input_byte(&machine->in);
+                } else {
+                    int got = input_cell(&machine->in, &input_char, program->io_cell_size);
+                    if (got != 0) input_char = got;
+                }
+                if (input_char == INPUT_AGAIN) {
+                    // Non-blocking input has nothing yet: stop before the ','
+                    if (profile_counts) profile_counts[ip]--;
+                    status = EXEC_INPUT; goto stop;
+                }
+                int old_val = cell->data;
                 int new_val = (input_char == EOF) ? 0 : input_char;
-                current_active_pointer->set_value(current_active_pointer, new_val);
-                if (debug_enabled) fprintf(stderr, " Read %d. Val:%d -> %d\n", input_char, old_val, new_val);
+                cell->data = new_val;
+                if (trace) fprintf(stderr, " Read %d. Val:%d -> %d\n", input_char, old_val, new_val);
                 break;
             }
             case '[': {
-                 int current_val = get_value(current_active_pointer);
-                 if (debug_enabled) fprintf(stderr, " (Test Val:%d)", current_val);
+                 int current_val = cell->data;
+                 if (trace) fprintf(stderr, " (Test Val:%d)", current_val);
                 if (current_val == 0) {
-                    if (interp->bracket_map[ip] == -1) { fprintf(stderr, " Error: Unmatched '['\n"); return -1;}
-                     if (debug_enabled) fprintf(stderr, " -> Jumping to %d\n", interp->bracket_map[ip]);
-                    ip = interp->bracket_map[ip]; // Jump past matching ]
+                    if (program->bracket_map[ip] == -1) { runtime_error(machine, " Error: Unmatched '['\n"); status = EXEC_ERROR; goto stop; }
+                     if (trace) fprintf(stderr, " -> Jumping to %d\n", program->bracket_map[ip]);
+                    ip = program->bracket_map[ip]; // Jump past matching ]
                 } else {
-                     if (debug_enabled) fprintf(stderr, " -> Entering loop\n");
+                     if (trace) fprintf(stderr, " -> Entering loop\n");
                 }
-                break;
+                ip++;
+                goto next_block;
             }
             case ']': {
-                 int current_val = get_value(current_active_pointer);
-                 if (debug_enabled) fprintf(stderr, " (Test Val:%d)", current_val);
+                 int current_val = cell->data;
+                 if (trace) fprintf(stderr, " (Test Val:%d)", current_val);
                 if (current_val != 0) {
-                     if (interp->bracket_map[ip] == -1) { fprintf(stderr, " Error: Unmatched ']'\n"); return -1;}
-                      if (debug_enabled) fprintf(stderr, " -> Jumping back to %d\n", interp->bracket_map[ip]);
-                    ip = interp->bracket_map[ip]; // Jump back to matching [
+                     if (program->bracket_map[ip] == -1) { runtime_error(machine, " Error: Unmatched ']'\n"); status = EXEC_ERROR; goto stop; }
+                      if (trace) fprintf(stderr, " -> Jumping back to %d\n", program->bracket_map[ip]);
+                    ip = program->bracket_map[ip]; // Jump back to matching [
+                    if (atomic_load_explicit(time_up, memory_order_relaxed)) {
+                        block_end = ++ip; // Resume at the start of the body
+                        status = EXEC_TIMEOUT; goto stop;
+                    }
                 } else {
-                     if (debug_enabled) fprintf(stderr, " -> Exiting loop\n");
+                     if (trace) fprintf(stderr, " -> Exiting loop\n");
                 }
-                break;
+                ip++;
+                goto next_block;
             }
             case '(': {
-                if (interp->pointer_stack_top + 1 >= MAX_POINTER_STACK_DEPTH) {
-                    fprintf(stderr, "错误: 临时指针堆栈溢出\n"); return -1;
+                if (!trace && program->parallel_group_at && program->parallel_group_at[ip] >= 0) {
+                    const ParallelGroup* group = &program->parallel_groups[program->parallel_group_at[ip]];
+                    size_t used;
+                    if (run_parallel_group(machine, group, cell, instruction_limit - (instruction_count - 1),
+                                           &used) == 0) {
+                        instruction_count += used - 1;
+                        cell = node_relative(cell, group->move); // Exists already
+                        ip = group->end;
+                        goto next_block;
+                    }
+                }
+                if (machine->pointer_stack_top + 1 >= MAX_POINTER_STACK_DEPTH) {
+                    runtime_error(machine, "错误: 临时指针堆栈溢出\n"); status = EXEC_ERROR; goto stop;
                 }
                 
-                // 将当前指针放入堆栈
-                interp->pointer_stack_top++;
-                interp->pointer_stack[interp->pointer_stack_top] = current_active_pointer;
+                // 将当前指针放入堆栈 (spill the cached cell first)
+                current_active_pointer->current = cell;
+                machine->pointer_stack_top++;
+                machine->pointer_stack[machine->pointer_stack_top] = current_active_pointer;
                 
                 // 创建新的临时指针作为当前活动指针
-                current_active_pointer = create_temp_pointer(current_active_pointer);
-                if (!current_active_pointer) {
-                    fprintf(stderr, "错误: 无法创建临时指针\n");
-                    return -1;
+                Pointer* temp_pointer = create_temp_pointer(current_active_pointer);
+                if (!temp_pointer) {
+                    machine->pointer_stack_top--;
+                    runtime_error(machine, "错误: 无法创建临时指针\n");
+                    status = EXEC_ERROR; goto stop;
                 }
+                current_active_pointer = temp_pointer;
                 
-                if (debug_enabled) {
-                    int cell_value = get_value(current_active_pointer);
+                if (trace) {
                     fprintf(stderr, "-> 推入堆栈. 新堆栈顶: %d. 临时指针指向值: %d\n", 
-                        interp->pointer_stack_top, cell_value);
+                        machine->pointer_stack_top, cell->data);
+                }
+                if (program->parallel_group_at && program->parallel_group_at[ip] >= 0) {
+                    ip++; // The group ran sequentially; its '(' ends a block
+                    goto next_block;
                 }
                 break;
             }
             case ')': {
-                if (interp->pointer_stack_top < 0) { 
-                    fprintf(stderr, "错误: 临时指针堆栈下溢\n"); return -1;
+                if (machine->pointer_stack_top < 0) { 
+                    runtime_error(machine, "错误: 临时指针堆栈下溢\n"); status = EXEC_ERROR; goto stop;
                 }
                 
-                // 释放当前临时指针
+                // 释放当前临时指针 (its cached cell is discarded)
                 Pointer* ptr_to_free = current_active_pointer;
                 
                 // 从堆栈中恢复之前的指针
-                current_active_pointer = interp->pointer_stack[interp->pointer_stack_top];
-                interp->pointer_stack_top--;
+                current_active_pointer = machine->pointer_stack[machine->pointer_stack_top];
+                machine->pointer_stack_top--;
+                cell = current_active_pointer->current;
                 
-                if (debug_enabled) {
-                    int cell_value = get_value(current_active_pointer);
+                if (trace) {
                     fprintf(stderr, "-> 弹出堆栈. 新堆栈顶: %d. 活动指针指向值: %d\n", 
-                        interp->pointer_stack_top, cell_value);
+                        machine->pointer_stack_top, cell->data);
                 }
                 
                 // 释放临时指针结构体
@@ -533,15 +2757,17 @@ int run(Interpreter* interp) {
             }
             case '*': {
                 // 获取当前单元格的值作为偏移量
-                int offset = current_active_pointer->get_value(current_active_pointer);
+                int offset = cell->data;
                 
                 // 执行相对跳转
-                if (current_active_pointer->move_relative(current_active_pointer, offset) != 0) {
-                    fprintf(stderr, "运行时错误: 相对跳转失败，偏移量: %d, 指令位置: %zu\n", offset, ip);
-                    return -1;
+                Node* target = node_relative(cell, offset);
+                if (!target) {
+                    runtime_error(machine, "运行时错误: 相对跳转失败，偏移量: %d, 指令位置: %zu\n", offset, ip);
+                    status = EXEC_ERROR; goto stop;
                 }
+                cell = target;
                 
-                if (debug_enabled) {
+                if (trace) {
                     fprintf(stderr, " -> 相对跳转%d个单元格\n", offset);
                 }
                 break;
@@ -549,74 +2775,2529 @@ int run(Interpreter* interp) {
         }
         ip++;
     }
+    goto next_block;
 
-     if (instruction_count >= MAX_INSTRUCTIONS) {
-        fprintf(stderr, "Warning: Maximum instruction limit reached.\n");
-        // Consider returning error or success based on requirements
-    }
+stop:
+    // Take back what was charged for commands that never ran; the one at ip
+    // ran only if it failed
+    if (ip < block_end) instruction_count -= block_end - ip - (status == EXEC_ERROR);
+    current_active_pointer->current = cell;
+    machine->ip = ip;
+    machine->active_pointer = current_active_pointer;
+    machine->instruction_count = instruction_count;
+    return status;
+}
 
-    // Clean up any remaining temporary pointers if execution ended unexpectedly inside ()
-    // (Shouldn't happen with matched parens, but good practice)
-    while(interp->pointer_stack_top >= 0) {
-        free(interp->pointer_stack[interp->pointer_stack_top]);
-        interp->pointer_stack_top--;
-    }
+static ExecStatus execute_fast(Machine* machine, size_t instruction_limit, int stop_before_input) {
+    return execute_engine(machine, instruction_limit, stop_before_input, 0, 0);
+}
 
-    return 0; // Success
+static ExecStatus execute_profiled(Machine* machine, size_t instruction_limit, int stop_before_input) {
+    return execute_engine(machine, instruction_limit, stop_before_input, 0, 1);
 }
 
-// --- Main Program Entry ---
+static ExecStatus execute_traced(Machine* machine, size_t instruction_limit, int stop_before_input) {
+    return execute_engine(machine, instruction_limit, stop_before_input, 1, 1);
+}
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <filename.bfpp>\n", argv[0]);
-        return EXIT_FAILURE;
+// Picks the engine for the machine's instrumentation
+static ExecStatus execute(Machine* machine, size_t instruction_limit, int stop_before_input) {
+    if (machine->trace) return execute_traced(machine, instruction_limit, stop_before_input);
+    if (machine->profile_counts) return execute_profiled(machine, instruction_limit, stop_before_input);
+    return execute_fast(machine, instruction_limit, stop_before_input);
+}
+
+// Output produced ahead of time by prefix evaluation comes first
+static void emit_pending_output(Machine* machine) {
+    if (machine->pending_output_length > 0) {
+        output_bytes(&machine->out, machine->pending_output, machine->pending_output_length);
+        machine->pending_output_length = 0;
     }
+}
 
-    // --- Read Code File ---
-    FILE* code_file = fopen(argv[1], "r");
+// Blocks until the input descriptor is readable. Returns -1 if the input is
+// not a descriptor (a callback that would block).
+static int wait_for_input(Machine* machine) {
+    if (machine->in.fd < 0) return -1;
+    flush_output(&machine->out);
+    struct pollfd ready = { machine->in.fd, POLLIN, 0 };
+    while (poll(&ready, 1, -1) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return 0;
+}
+
+// Like execute(machine, limit, 0), but with checkpointing on it also stops
+// every CHECKPOINT_CHUNK instructions to see whether a checkpoint is due
+static ExecStatus execute_checkpointed(Machine* machine, size_t limit) {
+    if (!machine->checkpoint_path || machine->checkpoint_interval_ms == 0) return execute(machine, limit, 0);
+    for (;;) {
+        size_t chunk_limit = machine->instruction_count + CHECKPOINT_CHUNK;
+        if (chunk_limit < CHECKPOINT_CHUNK || chunk_limit > limit) chunk_limit = limit;
+        ExecStatus status = execute(machine, chunk_limit, 0);
+        if (status != EXEC_LIMIT || machine->instruction_count >= limit) return status;
+        if (monotonic_ms() - machine->last_checkpoint_ms >= machine->checkpoint_interval_ms) {
+            if (save_checkpoint(machine, machine->checkpoint_path) != 0) {
+                fprintf(stderr, "Warning: Failed to write checkpoint '%s'.\n", machine->checkpoint_path);
+            }
+            machine->last_checkpoint_ms = monotonic_ms();
+        }
+    }
+}
+
+// Called when a machine starts running. Starting over instead of from the
+// prefix snapshot gives the same result, so it does when profiling or
+// tracing needs to see the commands the prefix ran, and on start_over.
+static void leave_prefix_snapshot(Machine* machine, int start_over) {
+    if (!machine->at_prefix_snapshot) return;
+    machine->at_prefix_snapshot = 0;
+    if (start_over || machine->profile_counts || machine->trace) reset_execution(machine);
+}
+
+// run, returning why execution ended
+static ExecStatus run_machine(Machine* machine) {
+    // A snapshot already past a lower instruction limit would stop late
+    leave_prefix_snapshot(machine, machine->instruction_limit != 0
+                                   && machine->instruction_count > machine->instruction_limit);
+    emit_pending_output(machine);
+
+    size_t limit = machine->instruction_limit ? machine->instruction_limit : SIZE_MAX;
+    if (machine->time_limit_ms) {
+        machine->deadline = arm_deadline(machine->time_limit_ms);
+        if (!machine->deadline) fprintf(stderr, "Warning: Failed to start the time limit timer.\n");
+    }
+    ExecStatus status = execute_checkpointed(machine, limit);
+    // run blocks: wait for a non-blocking descriptor to have input
+    while (status == EXEC_INPUT && wait_for_input(machine) == 0) {
+        status = execute_checkpointed(machine, limit);
+    }
+    if (status == EXEC_INPUT) {
+        fprintf(stderr, "Error: No input available; use run_slice with non-blocking input.\n");
+        status = EXEC_ERROR;
+    }
+
+     if (status == EXEC_LIMIT) {
+        fprintf(stderr, "Warning: Maximum instruction limit reached.\n");
+        // Consider returning error or success based on requirements
+    }
+    if (status == EXEC_TIMEOUT) fprintf(stderr, "Warning: Time limit reached.\n");
+    if (machine->deadline) {
+        disarm_deadline(machine->deadline);
+        machine->deadline = NULL;
+    }
+
+    // Clean up any remaining temporary pointers if execution ended unexpectedly inside ()
+    // (Shouldn't happen with matched parens, but good practice)
+    release_temp_pointers(machine);
+    flush_output(&machine->out); // Ensure all output is written
+    return status;
+}
+
+int run(Machine* machine) {
+    return (run_machine(machine) == EXEC_ERROR) ? -1 : 0;
+}
+
+SliceStatus run_slice(Machine* machine, size_t fuel) {
+    leave_prefix_snapshot(machine, 0); // Slices ignore the instruction limit
+    emit_pending_output(machine);
+
+    size_t limit = machine->instruction_count + fuel;
+    if (limit < fuel) limit = SIZE_MAX;
+    ExecStatus status = execute(machine, limit, 0);
+
+    if (status == EXEC_DONE) release_temp_pointers(machine);
+    if (flush_output(&machine->out) != 0 && status != EXEC_ERROR) {
+        runtime_error(machine, "Error: Failed to write output.\n");
+        status = EXEC_ERROR;
+    }
+    switch (status) {
+        case EXEC_DONE:  return SLICE_DONE;
+        case EXEC_LIMIT: return SLICE_OUT_OF_FUEL;
+        case EXEC_INPUT: return SLICE_NEEDS_INPUT;
+        default:         return SLICE_ERROR;
+    }
+}
+
+void set_instruction_limit(Machine* machine, size_t limit) {
+    machine->instruction_limit = limit;
+}
+
+void set_time_limit(Machine* machine, unsigned milliseconds) {
+    machine->time_limit_ms = milliseconds;
+}
+
+size_t instructions_executed(const Machine* machine) {
+    return machine->instruction_count;
+}
+
+// --- Checkpoints ---
+//
+// A checkpoint file is a CheckpointHeader followed by a snapshot of the
+// machine (see Execution Snapshots), so restoring maps the file and builds
+// the tape straight from the mapping. It also records how far the run had
+// got in its input and output, so a restarted run continues both streams
+// where the checkpoint left them rather than where the preempted run died.
+
+typedef struct {
+    char magic[8];           // CHECKPOINT_MAGIC
+    uint64_t format_version; // CACHE_FORMAT_VERSION, which covers the snapshot layout
+    uint64_t code_hash;      // Program the checkpoint belongs to
+    uint64_t input_offset;   // Input bytes consumed
+    int64_t output_offset;   // Position in the output file, or -1 if it has none
+    uint64_t snapshot_size;  // Snapshot right after the header
+} CheckpointHeader;
+
+int save_checkpoint(Machine* machine, const char* path) {
+    if (flush_output(&machine->out) != 0) return -1;
+    size_t snapshot_size;
+    char* snapshot = encode_snapshot(machine, NULL, 0, &snapshot_size);
+    if (!snapshot) return -1;
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.format_version = CACHE_FORMAT_VERSION;
+    header.code_hash = machine->program->code_hash;
+    header.input_offset = input_consumed(&machine->in);
+    header.output_offset = -1;
+    // Output still queued for the writer thread is not in the file yet
+    if (machine->out.io) {
+        ring_drain(&machine->out.io->output);
+        if (atomic_load(&machine->out.io->write_failed)) {
+            free(snapshot);
+            return -1;
+        }
+    }
+    struct stat st;
+    if (machine->out.fd >= 0 && fstat(machine->out.fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        header.output_offset = lseek(machine->out.fd, 0, SEEK_CUR);
+    }
+    header.snapshot_size = snapshot_size;
+
+    // Renamed over path once complete, so a crash never leaves half a checkpoint
+    char tmp_path[4096 + 32];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%ld", path, (long)getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { free(snapshot); return -1; }
+    int write_status = write_all(fd, (const char*)&header, sizeof(header));
+    if (write_status == 0) write_status = write_all(fd, snapshot, snapshot_size);
+    if (write_status == 0) write_status = fsync(fd);
+    free(snapshot);
+    if (close(fd) != 0 || write_status != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int restore_checkpoint(Machine* machine, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open checkpoint '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    size_t mapping_size = 0;
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(CheckpointHeader)) {
+        mapping_size = (size_t)st.st_size;
+        mapping = mmap(NULL, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    const CheckpointHeader* header = (mapping != MAP_FAILED) ? (const CheckpointHeader*)mapping : NULL;
+    const char* snapshot = (const char*)mapping + sizeof(CheckpointHeader);
+    if (!header || memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0
+        || header->format_version != CACHE_FORMAT_VERSION
+        || header->snapshot_size > mapping_size - sizeof(CheckpointHeader)) {
+        fprintf(stderr, "Error: '%s' is not a valid checkpoint.\n", path);
+        if (header) munmap(mapping, mapping_size);
+        return -1;
+    }
+    if (header->code_hash != machine->program->code_hash) {
+        fprintf(stderr, "Error: Checkpoint '%s' was taken from a different program.\n", path);
+        munmap(mapping, mapping_size);
+        return -1;
+    }
+    if (check_snapshot(snapshot, header->snapshot_size, machine->program->code_length) != 0
+        || ((const SnapshotHeader*)snapshot)->output_length != 0) {
+        fprintf(stderr, "Error: '%s' is not a valid checkpoint.\n", path);
+        munmap(mapping, mapping_size);
+        return -1;
+    }
+    // Build the state first: input skipped for a checkpoint that then fails
+    // to restore could not be given back
+    if (restore_snapshot(machine, snapshot, header->snapshot_size) != 0) {
+        fprintf(stderr, "Error: Failed to restore checkpoint '%s'.\n", path);
+        munmap(mapping, mapping_size);
+        return -1;
+    }
+    machine->pending_output = NULL; // A checkpoint's output is already written
+    machine->at_prefix_snapshot = 0;
+    uint64_t input_offset = header->input_offset;
+    int64_t output_offset = header->output_offset;
+    munmap(mapping, mapping_size);
+
+    // The restarted run gets its input from the start again
+    uint64_t consumed = input_consumed(&machine->in);
+    uint64_t skip = (input_offset > consumed) ? input_offset - consumed : 0;
+    while (input_skip(&machine->in, &skip) == INPUT_AGAIN && wait_for_input(machine) == 0) {}
+    if (skip > 0) {
+        fprintf(stderr, "Error: The input ends before the position of checkpoint '%s'.\n", path);
+        return -1;
+    }
+    // Drop what the preempted run wrote after the checkpoint, if the output
+    // file still has it (e.g. opened with >>)
+    const OutputBuffer* out = &machine->out;
+    struct stat out_st;
+    if (output_offset >= 0 && out->fd >= 0 && fstat(out->fd, &out_st) == 0
+        && S_ISREG(out_st.st_mode) && out_st.st_size >= output_offset
+        && ftruncate(out->fd, output_offset) == 0) {
+        lseek(out->fd, output_offset, SEEK_SET);
+    }
+    return 0;
+}
+
+void set_checkpointing(Machine* machine, const char* path, unsigned interval_ms) {
+    machine->checkpoint_path = path;
+    machine->checkpoint_interval_ms = interval_ms;
+    machine->last_checkpoint_ms = monotonic_ms();
+}
+
+// --- Loop Profiling ---
+
+// Turns on per-command execution counts. source must be the source the
+// program was compiled from; it is re-filtered to recover line/column
+// information, which the (possibly cached) compiled code does not carry.
+int enable_profiling(Machine* machine, const char* source) {
+    char* filtered = filter_code_with_positions(source, &machine->source_map);
+    if (!filtered) return -1;
+    free(filtered);
+    machine->profile_counts = (size_t*)calloc(machine->program->code_length + 1, sizeof(size_t));
+    if (!machine->profile_counts) {
+        free(machine->source_map);
+        machine->source_map = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Prints every command and its effect to stderr as it runs. The tracing
+// engine runs fused commands one by one and parallel groups sequentially.
+void enable_tracing(Machine* machine) {
+    machine->trace = 1;
+}
+
+typedef struct {
+    size_t open;             // Position of '['
+    size_t iterations;       // Times the body ran (executions of ']')
+    size_t self_count;       // Commands executed directly in the body
+    size_t inclusive_count;  // Commands executed in the body and nested loops
+} LoopProfile;
+
+static int compare_loop_profiles(const void* a, const void* b) {
+    const LoopProfile* la = (const LoopProfile*)a;
+    const LoopProfile* lb = (const LoopProfile*)b;
+    if (la->inclusive_count != lb->inclusive_count) {
+        return (la->inclusive_count < lb->inclusive_count) ? 1 : -1;
+    }
+    return (la->open > lb->open) - (la->open < lb->open);
+}
+
+#define PROFILE_MAX_LOOPS_SHOWN 20
+
+// Prints the hottest loops, named after the source position of their '['
+void print_profile(const Machine* machine, FILE* out) {
+    if (!machine->profile_counts) return;
+    const Program* program = machine->program;
+
+    size_t loop_count = 0;
+    for (size_t i = 0; i < program->code_length; i++) {
+        if (is_loop_open(program->code[i])) loop_count++;
+    }
+    LoopProfile* loops = (LoopProfile*)calloc(loop_count + 1, sizeof(LoopProfile));
+    if (!loops) return;
+
+    size_t total = 0, n = 0;
+    for (size_t i = 0; i < program->code_length; i++) {
+        total += machine->profile_counts[i];
+        if (!is_loop_open(program->code[i])) continue;
+        size_t close = program->bracket_map[i];
+        LoopProfile* loop = &loops[n++];
+        loop->open = i;
+        loop->iterations = machine->profile_counts[close];
+        // Walk the body up to and including ']'; nested loop bodies only
+        // count towards the inclusive total
+        size_t j = i + 1;
+        while (j <= close) {
+            loop->self_count += machine->profile_counts[j];
+            loop->inclusive_count += machine->profile_counts[j];
+            if (is_loop_open(program->code[j])) {
+                size_t nested_close = program->bracket_map[j];
+                for (size_t k = j + 1; k < nested_close; k++) {
+                    loop->inclusive_count += machine->profile_counts[k];
+                }
+                j = nested_close;
+                continue;
+            }
+            j++;
+        }
+    }
+    qsort(loops, n, sizeof(LoopProfile), compare_loop_profiles);
+
+    fprintf(out, "--- Loop profile: %zu commands executed ---\n", total);
+    fprintf(out, "%12s %14s %14s %14s %7s\n", "line:col", "iterations", "self", "inclusive", "share");
+    for (size_t i = 0; i < n && i < PROFILE_MAX_LOOPS_SHOWN; i++) {
+        const LoopProfile* loop = &loops[i];
+        if (loop->inclusive_count == 0) break;
+        char where[32];
+        snprintf(where, sizeof(where), "%u:%u",
+                 machine->source_map[loop->open].line, machine->source_map[loop->open].column);
+        fprintf(out, "%12s %14zu %14zu %14zu %6.1f%%\n", where, loop->iterations,
+                loop->self_count, loop->inclusive_count,
+                total ? 100.0 * loop->inclusive_count / total : 0.0);
+    }
+    free(loops);
+}
+
+// --- Shared Library Backend ---
+//
+// Translates the program to C and builds it with the system compiler into a
+// position-independent shared library exporting
+//
+//   int bfpp_main(void* ctx, bfpp_read_fn read_cb, bfpp_write_fn write_cb);
+//
+// All execution state lives in a heap-allocated machine local to the call,
+// so any number of calls may run concurrently on different threads. I/O is
+// buffered inside the machine and handed to the callbacks in blocks; ctx is
+// passed through to them untouched. bfpp_main returns 0 on success and -1 on
+// a runtime error (out of memory, temporary pointer stack overflow).
+
+static const char* const emitted_prelude =
+    "#include <stdlib.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "/* Returns the number of bytes stored in buf; 0 means end of input */\n"
+    "typedef size_t (*bfpp_read_fn)(void* ctx, unsigned char* buf, size_t size);\n"
+    "typedef void (*bfpp_write_fn)(void* ctx, const unsigned char* buf, size_t size);\n"
+    "\n"
+    "#define BF_STACK_DEPTH 256\n"
+    "#define BF_IO_BUFFER 4096\n"
+    "#define BF_INITIAL_TAPE 1024\n"
+    "\n"
+    "typedef struct {\n"
+    "    int* tape;\n"
+    "    size_t size;\n"
+    "    size_t stack[BF_STACK_DEPTH];\n"
+    "    int top;\n"
+    "    void* ctx;\n"
+    "    bfpp_read_fn read_cb;\n"
+    "    bfpp_write_fn write_cb;\n"
+    "    size_t in_pos, in_len, out_len;\n"
+    "    unsigned char in[BF_IO_BUFFER];\n"
+    "    unsigned char out[BF_IO_BUFFER];\n"
+    "} bf_machine;\n"
+    "\n"
+    "static int bf_grow_right(bf_machine* m, size_t p) {\n"
+    "    size_t size = m->size * 2;\n"
+    "    while (size <= p) size *= 2;\n"
+    "    int* tape = (int*)realloc(m->tape, size * sizeof(int));\n"
+    "    if (!tape) return -1;\n"
+    "    memset(tape + m->size, 0, (size - m->size) * sizeof(int));\n"
+    "    m->tape = tape;\n"
+    "    m->size = size;\n"
+    "    return 0;\n"
+    "}\n"
+    "\n"
+    "/* Adds at least n cells on the left, shifting *p and saved positions */\n"
+    "static int bf_grow_left(bf_machine* m, size_t n, size_t* p) {\n"
+    "    size_t extra = m->size > n ? m->size : n;\n"
+    "    int* tape = (int*)malloc((m->size + extra) * sizeof(int));\n"
+    "    if (!tape) return -1;\n"
+    "    memset(tape, 0, extra * sizeof(int));\n"
+    "    memcpy(tape + extra, m->tape, m->size * sizeof(int));\n"
+    "    free(m->tape);\n"
+    "    m->tape = tape;\n"
+    "    m->size += extra;\n"
+    "    *p += extra;\n"
+    "    for (int i = 0; i <= m->top; i++) m->stack[i] += extra;\n"
+    "    return 0;\n"
+    "}\n"
+    "\n"
+    "static inline int bf_move(bf_machine* m, size_t* p, long offset) {\n"
+    "    if (offset < 0 && (size_t)-offset > *p\n"
+    "        && bf_grow_left(m, (size_t)-offset - *p, p)) return -1;\n"
+    "    *p += offset;\n"
+    "    if (*p >= m->size && bf_grow_right(m, *p)) return -1;\n"
+    "    return 0;\n"
+    "}\n"
+    "\n"
+    "static void bf_flush(bf_machine* m) {\n"
+    "    if (m->out_len) m->write_cb(m->ctx, m->out, m->out_len);\n"
+    "    m->out_len = 0;\n"
+    "}\n"
+    "\n"
+    "static inline void bf_put(bf_machine* m, int value) {\n"
+    "    if (m->out_len == BF_IO_BUFFER) bf_flush(m);\n"
+    "    m->out[m->out_len++] = (unsigned char)value;\n"
+    "}\n"
+    "\n"
+    "static void bf_write(bf_machine* m, const char* data, size_t size) {\n"
+    "    if (size > BF_IO_BUFFER - m->out_len) bf_flush(m);\n"
+    "    if (size > BF_IO_BUFFER) {\n"
+    "        m->write_cb(m->ctx, (const unsigned char*)data, size);\n"
+    "        return;\n"
+    "    }\n"
+    "    memcpy(m->out + m->out_len, data, size);\n"
+    "    m->out_len += size;\n"
+    "}\n"
+    "\n"
+    "static inline int bf_get(bf_machine* m) {\n"
+    "    if (m->in_pos == m->in_len) {\n"
+    "        bf_flush(m); /* Let the host see output before asking for input */\n"
+    "        m->in_len = m->read_cb ? m->read_cb(m->ctx, m->in, BF_IO_BUFFER) : 0;\n"
+    "        m->in_pos = 0;\n"
+    "        if (m->in_len == 0) return 0; /* EOF reads as 0 */\n"
+    "    }\n"
+    "    return m->in[m->in_pos++];\n"
+    "}\n"
+    "\n"
+    "#define BF_ADD(n) m->tape[p] += (n)\n"
+    "#define BF_MOVE(n) if (bf_move(m, &p, (n))) goto fail\n"
+    "#define BF_OUT() bf_put(m, m->tape[p])\n"
+    "#define BF_IN() m->tape[p] = bf_get(m)\n"
+    "#define BF_PUSH() if (m->top + 1 >= BF_STACK_DEPTH) goto fail; m->stack[++m->top] = p\n"
+    "#define BF_POP() p = m->stack[m->top--]\n"
+    "\n"
+    "__attribute__((visibility(\"default\")))\n"
+    "int bfpp_main(void* ctx, bfpp_read_fn read_cb, bfpp_write_fn write_cb) {\n"
+    "    int status = -1;\n"
+    "    bf_machine* m = (bf_machine*)calloc(1, sizeof(bf_machine));\n"
+    "    if (!m) return -1;\n"
+    "    m->tape = (int*)calloc(BF_INITIAL_TAPE, sizeof(int));\n"
+    "    if (!m->tape) { free(m); return -1; }\n"
+    "    m->size = BF_INITIAL_TAPE;\n"
+    "    m->top = -1;\n"
+    "    m->ctx = ctx;\n"
+    "    m->read_cb = read_cb;\n"
+    "    m->write_cb = write_cb;\n"
+    "    size_t p = BF_INITIAL_TAPE / 4; /* Room for moving left of the start */\n"
+    "\n";
+
+static const char* const emitted_epilogue =
+    "\n"
+    "    status = 0;\n"
+    "fail:\n"
+    "    bf_flush(m);\n"
+    "    free(m->tape);\n"
+    "    free(m);\n"
+    "    return status;\n"
+    "}\n";
+
+// Writes the program as C source for the shared library backend. Runs of
+// '+'/'-' and '>'/'<' are merged; loops become while loops, and folded
+// constant output becomes a single bf_write.
+int emit_c_source(const Program* program, FILE* out) {
+    const char* code = program->code;
+    int depth = 1;
+
+    fprintf(out, "/* Generated by brainfuckpp %s. Build with:\n"
+                 " *   cc -O2 -fwrapv -fPIC -shared -o program.so program.c */\n", BFPP_VERSION);
+    fputs(emitted_prelude, out);
+    for (size_t ip = 0; ip < program->code_length; ip++) {
+        char command = code[ip];
+        if (command == '/') continue; // No-op
+        if (command == ']' || command == ')') depth--;
+        fprintf(out, "%*s", depth * 4, "");
+        switch (command) {
+            case '+':
+            case '-': {
+                long delta = 0;
+                for (; ip < program->code_length && (code[ip] == '+' || code[ip] == '-'); ip++) {
+                    delta += (code[ip] == '+') ? 1 : -1;
+                }
+                ip--;
+                fprintf(out, "BF_ADD(%ld);\n", delta);
+                break;
+            }
+            case '>':
+            case '<': {
+                long delta = 0;
+                for (; ip < program->code_length && (code[ip] == '>' || code[ip] == '<'); ip++) {
+                    delta += (code[ip] == '>') ? 1 : -1;
+                }
+                ip--;
+                fprintf(out, "BF_MOVE(%ld);\n", delta);
+                break;
+            }
+            case '.': fputs("BF_OUT();\n", out); break;
+            case ',': fputs("BF_IN();\n", out); break;
+            case '[':
+            case OP_COPY_LOOP: fputs("while (m->tape[p]) {\n", out); depth++; break;
+            case ']': fputs("}\n", out); break;
+            case '(': fputs("{ BF_PUSH();\n", out); depth++; break;
+            case ')': fputs("BF_POP(); }\n", out); break;
+            case '*': fputs("BF_MOVE(m->tape[p]);\n", out); break;
+            case OP_WRITE_LITERAL: {
+                const LiteralOp* op = &program->literal_ops[program->bracket_map[ip]];
+                const unsigned char* bytes = (const unsigned char*)program->literal_bytes + op->output_offset;
+                fputs("bf_write(m, \"", out);
+                for (uint32_t k = 0; k < op->output_length; k++) {
+                    if (isalnum(bytes[k]) || bytes[k] == ' ') fputc(bytes[k], out);
+                    else fprintf(out, "\\%03o", bytes[k]); // Octal escapes never run on
+                }
+                fprintf(out, "\", %u);\n", op->output_length);
+                const CellDelta* deltas = program->literal_deltas + op->delta_offset;
+                int32_t at = 0;
+                for (uint32_t k = 0; k < op->delta_count; k++) {
+                    if (deltas[k].offset != at) {
+                        fprintf(out, "%*sBF_MOVE(%ld);\n", depth * 4, "", (long)deltas[k].offset - at);
+                    }
+                    fprintf(out, "%*sBF_ADD(%d);\n", depth * 4, "", deltas[k].delta);
+                    at = deltas[k].offset;
+                }
+                if (op->move != at) fprintf(out, "%*sBF_MOVE(%ld);\n", depth * 4, "", (long)op->move - at);
+                ip = op->end - 1;
+                break;
+            }
+        }
+    }
+    fputs(emitted_epilogue, out);
+    return ferror(out) ? -1 : 0;
+}
+
+// Emits the program as C into a temporary file and compiles it into a shared
+// library at path with $CC (default: cc). Returns 0 on success, -1 on failure.
+int emit_shared_library(const Program* program, const char* path) {
+    const char* tmp_dir = getenv("TMPDIR");
+    char source_path[4096];
+    snprintf(source_path, sizeof(source_path), "%s/bfpp-XXXXXX.c",
+             (tmp_dir && tmp_dir[0]) ? tmp_dir : "/tmp");
+    int fd = mkstemps(source_path, 2);
+    if (fd < 0) { perror("Error creating temporary source file"); return -1; }
+    FILE* source = fdopen(fd, "w");
+    if (!source) { close(fd); unlink(source_path); return -1; }
+    int status = emit_c_source(program, source);
+    if (fclose(source) != 0) status = -1;
+    if (status != 0) {
+        fprintf(stderr, "Error: Failed to write generated C source.\n");
+        unlink(source_path);
+        return -1;
+    }
+
+    const char* cc = getenv("CC");
+    if (!cc || !cc[0]) cc = "cc";
+    char* const args[] = {
+        (char*)cc, "-O2", "-fwrapv", "-fPIC", "-shared", "-fvisibility=hidden",
+        "-o", (char*)path, source_path, NULL
+    };
+    extern char** environ;
+    pid_t pid;
+    int wait_status = 0;
+    status = posix_spawnp(&pid, cc, NULL, NULL, args, environ);
+    if (status != 0) {
+        fprintf(stderr, "Error: Failed to run C compiler '%s': %s\n", cc, strerror(status));
+        status = -1;
+    } else if (waitpid(pid, &wait_status, 0) < 0 || !WIFEXITED(wait_status)
+               || WEXITSTATUS(wait_status) != 0) {
+        fprintf(stderr, "Error: C compiler '%s' failed to build '%s'.\n", cc, path);
+        status = -1;
+    }
+    unlink(source_path);
+    return status;
+}
+
+// --- Command Line Tool ---
+// Everything below is left out with -DBFPP_NO_MAIN when building the
+// interpreter as a library
+
+#ifndef BFPP_NO_MAIN
+
+// Reads a program file into a malloc'd, NUL-terminated buffer. Reports
+// errors on stderr and returns NULL.
+static char* read_code_file(const char* filename) {
+    FILE* code_file = fopen(filename, "r");
     if (!code_file) {
-        perror("Error opening code file");
-        return EXIT_FAILURE;
+        fprintf(stderr, "Error opening code file '%s': %s\n", filename, strerror(errno));
+        return NULL;
     }
 
     // Get file size
     fseek(code_file, 0, SEEK_END);
     long file_size = ftell(code_file);
     if (file_size < 0) {
-        perror("Error getting file size"); fclose(code_file); return EXIT_FAILURE;
+        perror("Error getting file size"); fclose(code_file); return NULL;
     }
     fseek(code_file, 0, SEEK_SET);
 
     // Basic size check
      if (file_size > MAX_CODE_SIZE * 5) { // Allow extra for comments/whitespace
         fprintf(stderr, "Error: Code file size (%ld bytes) seems excessively large.\n", file_size);
-        fclose(code_file); return EXIT_FAILURE;
+        fclose(code_file); return NULL;
     }
 
     // Read into buffer
     char* code_buffer = (char*)malloc(file_size + 1);
     if (!code_buffer) {
         fprintf(stderr, "Error: Failed to allocate memory for code buffer.\n");
-        fclose(code_file); return EXIT_FAILURE;
+        fclose(code_file); return NULL;
     }
     size_t bytes_read = fread(code_buffer, 1, file_size, code_file);
     if (bytes_read != (size_t)file_size && ferror(code_file)) {
          perror("Error reading code file");
-         free(code_buffer); fclose(code_file); return EXIT_FAILURE;
+         free(code_buffer); fclose(code_file); return NULL;
     }
     code_buffer[bytes_read] = '\0';
     fclose(code_file);
+    return code_buffer;
+}
+
+// --- Lockstep Execution ---
+//
+// --simt runs up to SIMT_LANES inputs of one program together, each command
+// once for all of them. The lanes' tapes are interleaved cell by cell
+// (cells[row * SIMT_LANES + lane]), so a command applied where every lane's
+// pointer is on the same row is a single vector operation. Lanes only part
+// ways at '[' and ']': a loop runs with the mask of lanes whose cell was
+// nonzero, and the others wait after its ']' until it has ended for all of
+// them. The () nesting at each command is the same for every lane, so only
+// the pointers differ. Instruction counts are kept per lane, so the limit
+// stops each lane exactly where run() would. Lanes start at the beginning
+// of the program, not at its prefix snapshot, which gives the same result.
+
+#define SIMT_LANES 16
+#define SIMT_INITIAL_ROWS 4096
+#define SIMT_MAX_ROWS (1 << 18) // Tape per lane before giving up on lockstep
+
+typedef struct {
+    InputBuffer in;
+    OutputBuffer out;
+    int status;                  // 0, or -1 after a runtime error
+    const char* message;         // Reported once the whole group has finished
+} SimtLane;
+
+typedef struct {
+    size_t close;                // Position of the loop's ']'
+    uint32_t saved;              // Mask when the loop was entered
+    int depth;                   // () nesting at the loop
+} SimtLoop;
+
+typedef struct {
+    const Program* program;
+    SimtLane* lanes;
+    unsigned lane_count;
+    uint32_t* cells;             // rows * SIMT_LANES, wrapping like int cells
+    long rows;
+    long pos[SIMT_LANES];        // Row of each lane's pointer
+    long saved_pos[MAX_POINTER_STACK_DEPTH][SIMT_LANES]; // Pointers pushed by '('
+    int depth;                   // Current () nesting
+    uint32_t mask;               // Lanes executing the current command
+    uint32_t finished;           // Lanes that stopped early (limit or error)
+    int32_t active[SIMT_LANES];  // mask as 0 / -1 per lane
+    size_t steps;                // Commands executed with any lane active
+    size_t skipped[SIMT_LANES];  // Of those, the ones the lane sat out
+    size_t masked_at[SIMT_LANES];
+    size_t limit;
+    size_t headroom;             // Commands before some active lane reaches limit
+    const atomic_int* time_up;   // The group's time limit expired
+    SimtLoop loops[MAX_NESTING_DEPTH];
+    int loop_depth;
+} SimtGroup;
+
+static void simt_set_mask(SimtGroup* g, uint32_t mask) {
+    size_t most = 0;
+    for (unsigned l = 0; l < SIMT_LANES; l++) {
+        uint32_t bit = 1u << l;
+        if ((g->mask & bit) && !(mask & bit)) g->masked_at[l] = g->steps;
+        if (!(g->mask & bit) && (mask & bit)) g->skipped[l] += g->steps - g->masked_at[l];
+        g->active[l] = (mask & bit) ? -1 : 0;
+        if ((mask & bit) && g->steps - g->skipped[l] > most) most = g->steps - g->skipped[l];
+    }
+    g->mask = mask;
+    g->headroom = g->limit - most;
+}
+
+// Stops the active lanes that have used up the instruction limit
+static void simt_stop_at_limit(SimtGroup* g) {
+    uint32_t spent = 0;
+    for (unsigned l = 0; l < SIMT_LANES; l++) {
+        if ((g->mask >> l & 1) && g->steps - g->skipped[l] == g->limit) {
+            spent |= 1u << l;
+            g->lanes[l].message = "Warning: Maximum instruction limit reached.\n";
+        }
+    }
+    g->finished |= spent;
+    simt_set_mask(g, g->mask & ~spent);
+}
+
+// Stops every lane that has not finished; they all started together
+static void simt_stop_at_time_limit(SimtGroup* g) {
+    for (unsigned l = 0; l < g->lane_count; l++) {
+        if (!(g->finished >> l & 1)) g->lanes[l].message = "Warning: Time limit reached.\n";
+    }
+    g->finished = (1u << g->lane_count) - 1;
+    simt_set_mask(g, 0);
+}
+
+// The row all active lanes point at, or NULL if they point at different rows
+static uint32_t* simt_row(SimtGroup* g) {
+    long first = g->pos[__builtin_ctz(g->mask)];
+    long differ = 0;
+    for (unsigned l = 0; l < SIMT_LANES; l++) differ |= (g->pos[l] ^ first) & g->active[l];
+    return differ ? NULL : g->cells + first * SIMT_LANES;
+}
+
+static inline uint32_t* simt_cell(SimtGroup* g, unsigned lane) {
+    return &g->cells[g->pos[lane] * SIMT_LANES + lane];
+}
+
+// Grows the tape until every active pointer is on it. Returns -1 if that
+// would take more than SIMT_MAX_ROWS rows.
+static int simt_fit(SimtGroup* g) {
+    long lo = 0, hi = g->rows;
+    for (unsigned l = 0; l < SIMT_LANES; l++) {
+        if (!g->active[l]) continue;
+        if (g->pos[l] < lo) lo = g->pos[l];
+        if (g->pos[l] >= hi) hi = g->pos[l] + 1;
+    }
+    if (lo == 0 && hi == g->rows) return 0;
+    if (hi - lo > SIMT_MAX_ROWS) return -1;
+
+    long rows = g->rows;
+    while (rows < 2 * (hi - lo) && rows < SIMT_MAX_ROWS) rows *= 2;
+    if (rows > SIMT_MAX_ROWS) rows = SIMT_MAX_ROWS;
+    long shift = (rows - (hi - lo)) / 2 - lo; // Center the used rows
+    uint32_t* cells = (uint32_t*)calloc((size_t)rows * SIMT_LANES, sizeof(uint32_t));
+    if (!cells) return -1;
+    memcpy(cells + shift * SIMT_LANES, g->cells, (size_t)g->rows * SIMT_LANES * sizeof(uint32_t));
+    free(g->cells);
+    g->cells = cells;
+    g->rows = rows;
+    for (unsigned l = 0; l < SIMT_LANES; l++) {
+        g->pos[l] += shift;
+        for (int d = 0; d < g->depth; d++) g->saved_pos[d][l] += shift;
+    }
+    return 0;
+}
+
+// Runs every lane to completion. Returns -1 if the group cannot continue in
+// lockstep (its tape grew too large or input would block); the lanes must
+// then be run on their own.
+static int simt_execute(SimtGroup* g) {
+    const Program* program = g->program;
+    const char* code = program->code;
+    size_t length = program->code_length;
+    size_t ip = 0;
+
+    while (ip < length) {
+        if (g->mask == 0) {
+            // Every lane in the innermost loop has stopped early: resume
+            // the ones waiting after it
+            if (g->loop_depth == 0) break;
+            const SimtLoop* loop = &g->loops[--g->loop_depth];
+            simt_set_mask(g, loop->saved & ~g->finished);
+            g->depth = loop->depth;
+            ip = loop->close + 1;
+            continue;
+        }
+        if (g->headroom == 0) {
+            simt_stop_at_limit(g);
+            continue;
+        }
+
+        char command = code[ip];
+        if (command == OP_WRITE_LITERAL) command = program->literal_ops[program->bracket_map[ip]].original;
+        else if (command == OP_COPY_LOOP) command = '[';
+
+        // Runs of '+'/'-' and of '<'/'>' are applied at once
+        size_t n = 1;
+        if (command == '+' || command == '-') {
+            while (n < g->headroom && ip + n < length && (code[ip + n] == '+' || code[ip + n] == '-')) n++;
+        } else if (command == '<' || command == '>') {
+            while (n < g->headroom && ip + n < length && (code[ip + n] == '<' || code[ip + n] == '>')) n++;
+        }
+        g->steps += n;
+        g->headroom -= n;
+
+        switch (command) {
+            case '+':
+            case '-': {
+                uint32_t delta = 0;
+                for (size_t k = 0; k < n; k++) {
+                    delta += ((k ? code[ip + k] : command) == '+') ? 1u : -1u;
+                }
+                uint32_t* row = simt_row(g);
+                if (row) {
+                    for (unsigned l = 0; l < SIMT_LANES; l++) row[l] += delta & (uint32_t)g->active[l];
+                } else {
+                    for (unsigned l = 0; l < SIMT_LANES; l++) {
+                        if (g->active[l]) *simt_cell(g, l) += delta;
+                    }
+                }
+                break;
+            }
+            case '<':
+            case '>': {
+                long move = 0;
+                for (size_t k = 0; k < n; k++) move += ((k ? code[ip + k] : command) == '>') ? 1 : -1;
+                for (unsigned l = 0; l < SIMT_LANES; l++) g->pos[l] += move & g->active[l];
+                if (simt_fit(g) != 0) return -1;
+                break;
+            }
+            case '*': {
+                for (unsigned l = 0; l < SIMT_LANES; l++) {
+                    if (g->active[l]) g->pos[l] += (int32_t)*simt_cell(g, l);
+                }
+                if (simt_fit(g) != 0) return -1;
+                break;
+            }
+            case '.': {
+                for (unsigned l = 0; l < SIMT_LANES; l++) {
+                    if (!g->active[l]) continue;
+                    int value = (int32_t)*simt_cell(g, l);
+                    if (program->io_cell_size == 1) output_byte(&g->lanes[l].out, value);
+                    else output_cell(&g->lanes[l].out, value, program->io_cell_size);
+                }
+                break;
+            }
+            case ',': {
+                for (unsigned l = 0; l < SIMT_LANES; l++) {
+                    if (!g->active[l]) continue;
+                    int input_char;
+                    if (program->io_cell_size == 1) {
+                        input_char = input_byte(&g->lanes[l].in);
+                    } else {
+                        int got = input_cell(&g->lanes[l].in, &input_char, program->io_cell_size);
+                        if (got != 0) input_char = got;
+                    }
+                    if (input_char == INPUT_AGAIN) return -1;
+                    *simt_cell(g, l) = (input_char == EOF) ? 0 : (uint32_t)input_char;
+                }
+                break;
+            }
+            case '[':
+            case ']': {
+                uint32_t live = 0;
+                for (unsigned l = 0; l < SIMT_LANES; l++) {
+                    if (g->active[l] && *simt_cell(g, l) != 0) live |= 1u << l;
+                }
+                if (command == '[') {
+                    if (live == 0) {
+                        ip = program->bracket_map[ip]; // Nobody enters: skip the loop
+                        break;
+                    }
+                    SimtLoop* loop = &g->loops[g->loop_depth++];
+                    loop->close = program->bracket_map[ip];
+                    loop->saved = g->mask;
+                    loop->depth = g->depth;
+                    if (live != g->mask) simt_set_mask(g, live);
+                } else if (live) {
+                    if (atomic_load_explicit(g->time_up, memory_order_relaxed)) {
+                        simt_stop_at_time_limit(g);
+                        return 0;
+                    }
+                    if (live != g->mask) simt_set_mask(g, live);
+                    ip = program->bracket_map[ip];
+                } else {
+                    // Last lane out: everyone who entered continues together
+                    const SimtLoop* loop = &g->loops[--g->loop_depth];
+                    simt_set_mask(g, loop->saved & ~g->finished);
+                }
+                break;
+            }
+            case '(': {
+                if (g->depth >= MAX_POINTER_STACK_DEPTH) {
+                    // Same nesting in every lane, so they all fail here
+                    for (unsigned l = 0; l < SIMT_LANES; l++) {
+                        if (!g->active[l]) continue;
+                        g->lanes[l].status = -1;
+                        g->lanes[l].message = "错误: 临时指针堆栈溢出\n";
+                    }
+                    g->finished |= g->mask;
+                    simt_set_mask(g, 0);
+                    continue;
+                }
+                memcpy(g->saved_pos[g->depth++], g->pos, sizeof(g->pos));
+                break;
+            }
+            case ')': {
+                const long* saved = g->saved_pos[--g->depth];
+                for (unsigned l = 0; l < SIMT_LANES; l++) {
+                    if (g->active[l]) g->pos[l] = saved[l];
+                }
+                break;
+            }
+        }
+        ip += n;
+    }
+    return 0;
+}
+
+// --- Batch Mode ---
+//
+// --batch runs every line of a manifest, "PROGRAM [INPUT|- [OUTPUT]]", as
+// one task: PROGRAM reads INPUT (none for "-" or when missing) and its
+// output goes to OUTPUT, or to stdout in manifest order. Each distinct
+// program is compiled once and shared by all its tasks. Tasks run on a
+// pool of workers that each own a range of tasks, take from its front and,
+// once it is empty, steal the back half of another worker's range. With
+// --simt a worker also takes the following tasks of the same program from
+// its range and runs them in lockstep (see Lockstep Execution).
+
+typedef struct {
+    size_t line;                // Manifest line, for messages
+    const char* program_path;
+    const char* input_path;     // NULL: no input
+    const char* output_path;    // NULL: stdout, in manifest order
+    const Program* program;
+    char* output;               // Captured output waiting to go to stdout
+    size_t output_length;
+    int status;                 // 0 on success
+    int done;                   // Guarded by BatchPool.done_lock
+} BatchTask;
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t begin, end;          // Tasks not taken yet
+} TaskRange;
+
+typedef struct {
+    BatchTask* tasks;
+    size_t task_count;
+    TaskRange* ranges;          // One per worker
+    unsigned worker_count;
+    pthread_mutex_t done_lock;
+    pthread_cond_t done_cond;
+    size_t instruction_limit;   // Per task, see set_instruction_limit
+    unsigned time_limit_ms;     // Per task, see set_time_limit
+    int lockstep;               // --simt: run tasks of the same program together
+} BatchPool;
+
+typedef struct {
+    BatchPool* pool;
+    unsigned index;
+} BatchWorker;
+
+// Takes the next task for worker self; returns 0 when no work is left
+static int take_task(BatchPool* pool, unsigned self, size_t* task) {
+    TaskRange* own = &pool->ranges[self];
+    pthread_mutex_lock(&own->lock);
+    int found = own->begin < own->end;
+    if (found) *task = own->begin++;
+    pthread_mutex_unlock(&own->lock);
+    if (found) return 1;
+
+    // Tasks never create tasks, so once every range is empty we are done
+    for (unsigned k = 1; k < pool->worker_count; k++) {
+        TaskRange* victim = &pool->ranges[(self + k) % pool->worker_count];
+        pthread_mutex_lock(&victim->lock);
+        size_t left = victim->end - victim->begin;
+        size_t start = victim->end - (left + 1) / 2;
+        if (left > 0) victim->end = start;
+        pthread_mutex_unlock(&victim->lock);
+        if (left == 0) continue;
+
+        pthread_mutex_lock(&own->lock);
+        own->begin = start + 1;
+        own->end = start + (left + 1) / 2;
+        pthread_mutex_unlock(&own->lock);
+        *task = start;
+        return 1;
+    }
+    return 0;
+}
+
+static void run_batch_task(BatchTask* task, size_t instruction_limit, unsigned time_limit_ms) {
+    task->status = -1;
+    if (!task->program) return;
+    int input_fd = -1;
+    if (task->input_path) {
+        input_fd = open(task->input_path, O_RDONLY);
+        if (input_fd < 0) {
+            fprintf(stderr, "Error: Line %zu: cannot open input '%s': %s\n",
+                    task->line, task->input_path, strerror(errno));
+            return;
+        }
+    }
+    MachineIo io = fd_io(input_fd, -1);
+    if (input_fd < 0) io.read = NULL;
+    io.write = NULL; // Captured in memory
+    io.interactive = 0;
+    Machine* machine = create_machine(task->program, &io);
+    if (machine) {
+        set_instruction_limit(machine, instruction_limit);
+        set_time_limit(machine, time_limit_ms);
+        task->status = run(machine);
+        if (machine->out.failed) task->status = -1;
+        // Keep the captured output beyond the machine
+        task->output = machine->out.data;
+        task->output_length = machine->out.length;
+        machine->out.data = NULL;
+        free_machine(machine);
+    }
+    if (input_fd >= 0) close(input_fd);
+}
+
+// Writes a task's output to its OUTPUT file, if it has one
+static void store_batch_output(BatchTask* task) {
+    if (task->output_path) {
+        int fd = open(task->output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || write_all(fd, task->output, task->output_length) != 0) {
+            fprintf(stderr, "Error: Line %zu: cannot write output '%s': %s\n",
+                    task->line, task->output_path, strerror(errno));
+            task->status = -1;
+        }
+        if (fd >= 0) close(fd);
+        free(task->output);
+        task->output = NULL;
+    }
+}
+
+// Takes up to max more tasks of program from the front of worker self's
+// range (--simt). Returns how many were taken.
+static unsigned take_companions(BatchPool* pool, unsigned self, const Program* program,
+                                size_t* tasks, unsigned max) {
+    TaskRange* own = &pool->ranges[self];
+    unsigned count = 0;
+    pthread_mutex_lock(&own->lock);
+    while (count < max && own->begin < own->end && pool->tasks[own->begin].program == program) {
+        tasks[count++] = own->begin++;
+    }
+    pthread_mutex_unlock(&own->lock);
+    return count;
+}
+
+// Runs tasks of the same program in lockstep. Returns -1 if they have to be
+// run one by one instead; nothing they did is kept in that case.
+static int run_lockstep_tasks(BatchTask** tasks, unsigned count, size_t instruction_limit,
+                              unsigned time_limit_ms) {
+    int input_fds[SIMT_LANES];
+    unsigned opened = 0;
+    for (; opened < count; opened++) {
+        input_fds[opened] = -1;
+        if (!tasks[opened]->input_path) continue;
+        input_fds[opened] = open(tasks[opened]->input_path, O_RDONLY);
+        if (input_fds[opened] < 0) break; // Reported when the task runs by itself
+    }
+    SimtGroup* g = (opened == count) ? (SimtGroup*)calloc(1, sizeof(SimtGroup)) : NULL;
+    SimtLane lanes[SIMT_LANES];
+    unsigned ready = 0;
+    int status = -1;
+    if (g) {
+        g->program = tasks[0]->program;
+        g->lanes = lanes;
+        g->lane_count = count;
+        g->rows = SIMT_INITIAL_ROWS;
+        g->cells = (uint32_t*)calloc((size_t)g->rows * SIMT_LANES, sizeof(uint32_t));
+        g->limit = instruction_limit ? instruction_limit : SIZE_MAX;
+        for (unsigned l = 0; l < SIMT_LANES; l++) g->pos[l] = g->rows / 2;
+        for (; g->cells && ready < count; ready++) {
+            MachineIo io = fd_io(input_fds[ready], -1);
+            if (input_fds[ready] < 0) io.read = NULL;
+            io.write = NULL; // Captured in memory
+            io.interactive = 0;
+            SimtLane* lane = &lanes[ready];
+            lane->status = 0;
+            lane->message = NULL;
+            if (input_init(&lane->in, &io) != 0) break;
+            if (output_init(&lane->out, &io, OUTPUT_BUFFER_SIZE) != 0) {
+                input_release(&lane->in);
+                break;
+            }
+        }
+        if (ready == count) {
+            simt_set_mask(g, (1u << count) - 1);
+            Deadline* deadline = time_limit_ms ? arm_deadline(time_limit_ms) : NULL;
+            if (time_limit_ms && !deadline) fprintf(stderr, "Warning: Failed to start the time limit timer.\n");
+            g->time_up = deadline_flag(deadline);
+            status = simt_execute(g);
+            if (deadline) disarm_deadline(deadline);
+        }
+    }
+
+    for (unsigned l = 0; l < ready; l++) {
+        if (status == 0) {
+            if (lanes[l].message) fputs(lanes[l].message, stderr);
+            tasks[l]->status = lanes[l].out.failed ? -1 : lanes[l].status;
+            tasks[l]->output = lanes[l].out.data;
+            tasks[l]->output_length = lanes[l].out.length;
+        } else {
+            free(lanes[l].out.data);
+        }
+        input_release(&lanes[l].in);
+    }
+    for (unsigned l = 0; l < opened; l++) {
+        if (input_fds[l] >= 0) close(input_fds[l]);
+    }
+    if (g) free(g->cells);
+    free(g);
+    return status;
+}
+
+static void* batch_worker_main(void* arg) {
+    BatchWorker* worker = (BatchWorker*)arg;
+    BatchPool* pool = worker->pool;
+    size_t group[SIMT_LANES];
+    while (take_task(pool, worker->index, &group[0])) {
+        BatchTask* tasks[SIMT_LANES];
+        unsigned count = 1;
+        if (pool->lockstep && pool->tasks[group[0]].program) {
+            count += take_companions(pool, worker->index, pool->tasks[group[0]].program,
+                                     group + 1, SIMT_LANES - 1);
+        }
+        for (unsigned k = 0; k < count; k++) tasks[k] = &pool->tasks[group[k]];
+        if (count == 1
+            || run_lockstep_tasks(tasks, count, pool->instruction_limit, pool->time_limit_ms) != 0) {
+            for (unsigned k = 0; k < count; k++) {
+                run_batch_task(tasks[k], pool->instruction_limit, pool->time_limit_ms);
+            }
+        }
+        for (unsigned k = 0; k < count; k++) store_batch_output(tasks[k]);
+
+        pthread_mutex_lock(&pool->done_lock);
+        for (unsigned k = 0; k < count; k++) tasks[k]->done = 1;
+        pthread_cond_broadcast(&pool->done_cond);
+        pthread_mutex_unlock(&pool->done_lock);
+    }
+    return NULL;
+}
+
+// Parses the manifest in place. Returns the number of tasks, or -1.
+static long parse_manifest(char* text, BatchTask** tasks_out) {
+    size_t capacity = 64, count = 0, line = 0;
+    BatchTask* tasks = (BatchTask*)malloc(sizeof(BatchTask) * capacity);
+    if (!tasks) return -1;
+    for (char* next = text; next && *next; ) {
+        char* current = next;
+        next = strchr(current, '\n');
+        if (next) *next++ = '\0';
+        line++;
+
+        char* fields[4];
+        int field_count = 0;
+        for (char* token = strtok(current, " \t\r"); token; token = strtok(NULL, " \t\r")) {
+            if (token[0] == COMMENT_CHAR || field_count == 4) break;
+            fields[field_count++] = token;
+        }
+        if (field_count == 0) continue;
+        if (field_count > 3) {
+            fprintf(stderr, "Error: Manifest line %zu: expected PROGRAM [INPUT [OUTPUT]].\n", line);
+            free(tasks);
+            return -1;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            BatchTask* grown = (BatchTask*)realloc(tasks, sizeof(BatchTask) * capacity);
+            if (!grown) { free(tasks); return -1; }
+            tasks = grown;
+        }
+        BatchTask* task = &tasks[count++];
+        memset(task, 0, sizeof(*task));
+        task->line = line;
+        task->program_path = fields[0];
+        task->input_path = (field_count > 1 && strcmp(fields[1], "-") != 0) ? fields[1] : NULL;
+        task->output_path = (field_count > 2) ? fields[2] : NULL;
+    }
+    *tasks_out = tasks;
+    return (long)count;
+}
+
+// Runs a manifest with worker_count threads (0: one per core). Returns 0 if
+// every task succeeded.
+static int run_batch(const char* manifest_path, const CompileOptions* options, unsigned worker_count,
+                     size_t instruction_limit, unsigned time_limit_ms, int lockstep) {
+    char* manifest = read_code_file(manifest_path);
+    if (!manifest) return -1;
+    BatchTask* tasks = NULL;
+    long task_count = parse_manifest(manifest, &tasks);
+    if (task_count < 0) { free(manifest); return -1; }
+
+    // Compile each distinct program once
+    Program** programs = (Program**)calloc(task_count + 1, sizeof(Program*));
+    size_t program_count = 0;
+    int status = programs ? 0 : -1;
+    for (long i = 0; i < task_count && programs; i++) {
+        long first = 0;
+        while (strcmp(tasks[first].program_path, tasks[i].program_path) != 0) first++;
+        if (first < i) {
+            tasks[i].program = tasks[first].program;
+            continue;
+        }
+        char* source = read_code_file(tasks[i].program_path);
+        tasks[i].program = source ? compile_program(source, options) : NULL;
+        if (tasks[i].program) programs[program_count++] = (Program*)tasks[i].program;
+        free(source);
+    }
+
+    if (worker_count == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = cores > 0 ? (unsigned)cores : 1;
+    }
+    if (worker_count > (unsigned long)task_count) worker_count = task_count > 0 ? task_count : 1;
+    BatchPool pool = { tasks, (size_t)task_count, NULL, worker_count,
+                       PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, instruction_limit, time_limit_ms,
+                       lockstep };
+    pool.ranges = (TaskRange*)calloc(worker_count, sizeof(TaskRange));
+    BatchWorker* workers = (BatchWorker*)calloc(worker_count, sizeof(BatchWorker));
+    pthread_t* threads = (pthread_t*)calloc(worker_count, sizeof(pthread_t));
+    unsigned started = 0;
+    if (status == 0 && pool.ranges && workers && threads) {
+        for (unsigned w = 0; w < worker_count; w++) {
+            pthread_mutex_init(&pool.ranges[w].lock, NULL);
+            pool.ranges[w].begin = (size_t)task_count * w / worker_count;
+            pool.ranges[w].end = (size_t)task_count * (w + 1) / worker_count;
+            workers[w].pool = &pool;
+            workers[w].index = w;
+        }
+        while (started < worker_count
+               && pthread_create(&threads[started], NULL, batch_worker_main, &workers[started]) == 0) {
+            started++;
+        }
+        // With fewer threads, the running workers steal the rest
+        if (started == 0) batch_worker_main(&workers[0]);
+    } else {
+        status = -1;
+    }
+
+    // Results go out in manifest order as soon as each one is ready
+    for (long i = 0; status == 0 && i < task_count; i++) {
+        pthread_mutex_lock(&pool.done_lock);
+        while (!tasks[i].done) pthread_cond_wait(&pool.done_cond, &pool.done_lock);
+        pthread_mutex_unlock(&pool.done_lock);
+        if (tasks[i].output && write_all(STDOUT_FILENO, tasks[i].output, tasks[i].output_length) != 0) {
+            tasks[i].status = -1;
+        }
+        free(tasks[i].output);
+        tasks[i].output = NULL;
+        if (tasks[i].status != 0) {
+            fprintf(stderr, "Error: Line %zu: running '%s' failed.\n", tasks[i].line, tasks[i].program_path);
+        }
+    }
+    for (unsigned w = 0; w < started; w++) pthread_join(threads[w], NULL);
+    for (long i = 0; i < task_count; i++) {
+        if (tasks[i].status != 0) status = -1;
+    }
+
+    for (size_t p = 0; p < program_count; p++) free_program(programs[p]);
+    if (pool.ranges) {
+        for (unsigned w = 0; w < worker_count; w++) pthread_mutex_destroy(&pool.ranges[w].lock);
+    }
+    free(pool.ranges);
+    free(workers);
+    free(threads);
+    free(programs);
+    free(tasks);
+    free(manifest);
+    return status;
+}
+
+// --- Sharded Batch Mode ---
+//
+// --batch with --processes N runs the tasks on N forked worker processes
+// instead of threads, so a task that crashes the interpreter only takes
+// its own worker down. The coordinator compiles every program once into the
+// compiled code cache (--cache-dir, or a temporary directory) and the
+// workers load them from there, so they all share the same read-only
+// mappings. Workers pull tasks over a socket pair:
+//
+//   worker:      NEXT\n                                    (on start)
+//                DONE <task> <status> <length>\n<output>   (then waits)
+//   coordinator: TASK <task>\n
+//
+// Output meant for stdout comes back in DONE and is written in manifest
+// order. When a worker dies, its task goes back to the queue and another
+// worker takes its place; a task that has taken down SHARD_MAX_ATTEMPTS
+// workers fails.
+
+#define SHARD_MAX_ATTEMPTS 2
+#define SHARD_LINE_MAX 64
+
+typedef struct {
+    pid_t pid;                  // 0: not running
+    int fd;                     // Coordinator's end of the socket pair
+    long task;                  // Task being run, or -1
+} ShardWorker;
+
+typedef struct {
+    BatchTask* tasks;
+    size_t task_count;
+    char** sources;             // Program source, at the first task using it; NULL if invalid
+    size_t* first;              // First task with the same program
+    const CompileOptions* options;
+    size_t instruction_limit;
+    unsigned time_limit_ms;
+    ShardWorker* workers;
+    unsigned worker_count;
+    size_t next;                // Next task never handed out
+    size_t* retry;              // Tasks whose worker died
+    size_t retry_count;
+    unsigned char* attempts;
+} Shard;
+
+// Reads a '\n'-terminated line into line (without the '\n'). Returns -1 at
+// the end of input, on errors and on lines longer than size - 1.
+static int read_line_fd(int fd, char* line, size_t size) {
+    size_t length = 0;
+    while (length + 1 < size) {
+        ssize_t n = read(fd, &line[length], 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        if (line[length] == '\n') {
+            line[length] = '\0';
+            return 0;
+        }
+        length++;
+    }
+    return -1;
+}
+
+static int read_exact_fd(int fd, char* data, size_t length) {
+    while (length > 0) {
+        ssize_t n = read(fd, data, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static void shard_worker_main(Shard* shard, int fd) {
+    Program** loaded = (Program**)calloc(shard->task_count, sizeof(Program*));
+    char line[SHARD_LINE_MAX];
+    if (!loaded || write_all(fd, "NEXT\n", 5) != 0) _exit(EXIT_FAILURE);
+    unsigned long index;
+    while (read_line_fd(fd, line, sizeof(line)) == 0
+           && sscanf(line, "TASK %lu", &index) == 1 && index < shard->task_count) {
+        BatchTask* task = &shard->tasks[index];
+        size_t first = shard->first[index];
+        // A cache hit: maps the entry the coordinator wrote
+        if (!loaded[first]) loaded[first] = compile_program(shard->sources[first], shard->options);
+        task->program = loaded[first];
+        run_batch_task(task, shard->instruction_limit, shard->time_limit_ms);
+        store_batch_output(task);
+        if (!task->output) task->output_length = 0;
+
+        int length = snprintf(line, sizeof(line), "DONE %lu %d %zu\n", index, task->status, task->output_length);
+        if (write_all(fd, line, length) != 0 || write_all(fd, task->output, task->output_length) != 0) break;
+        free(task->output);
+        task->output = NULL;
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+static int start_shard_worker(Shard* shard, ShardWorker* worker) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return -1;
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        for (unsigned w = 0; w < shard->worker_count; w++) {
+            if (shard->workers[w].fd >= 0) close(shard->workers[w].fd);
+        }
+        close(sv[0]);
+        shard_worker_main(shard, sv[1]);
+    }
+    close(sv[1]);
+    worker->pid = pid;
+    worker->fd = sv[0];
+    worker->task = -1;
+    return 0;
+}
+
+static int shard_has_work(const Shard* shard) {
+    return shard->retry_count > 0 || shard->next < shard->task_count;
+}
+
+// Hands the next task to an idle worker. Returns -1 if the worker is gone.
+static int shard_assign(Shard* shard, ShardWorker* worker) {
+    if (!shard_has_work(shard)) return 0;
+    size_t index = shard->retry_count > 0 ? shard->retry[--shard->retry_count] : shard->next++;
+    worker->task = (long)index;
+    char line[SHARD_LINE_MAX];
+    int length = snprintf(line, sizeof(line), "TASK %zu\n", index);
+    return write_all(worker->fd, line, length);
+}
+
+// Cleans up after a worker that died or misbehaved, and starts another one
+// if there is work left
+static void shard_worker_lost(Shard* shard, ShardWorker* worker) {
+    kill(worker->pid, SIGKILL); // In case it is still alive
+    close(worker->fd);
+    waitpid(worker->pid, NULL, 0);
+    worker->pid = 0;
+    worker->fd = -1;
+    if (worker->task >= 0) {
+        BatchTask* task = &shard->tasks[worker->task];
+        if (++shard->attempts[worker->task] >= SHARD_MAX_ATTEMPTS) {
+            fprintf(stderr, "Error: Line %zu: '%s' crashed %d worker processes.\n",
+                    task->line, task->program_path, SHARD_MAX_ATTEMPTS);
+            task->status = -1;
+            task->done = 1;
+        } else {
+            shard->retry[shard->retry_count++] = (size_t)worker->task;
+        }
+        worker->task = -1;
+    }
+    if (shard_has_work(shard) && start_shard_worker(shard, worker) != 0) {
+        fprintf(stderr, "Error: Failed to restart a worker process: %s\n", strerror(errno));
+    }
+}
+
+// Handles one message from a worker
+static void shard_receive(Shard* shard, ShardWorker* worker) {
+    char line[SHARD_LINE_MAX];
+    unsigned long index;
+    int status;
+    size_t length;
+    if (read_line_fd(worker->fd, line, sizeof(line)) != 0) {
+        shard_worker_lost(shard, worker);
+        return;
+    }
+    if (strcmp(line, "NEXT") != 0) {
+        if (sscanf(line, "DONE %lu %d %zu", &index, &status, &length) != 3 || (long)index != worker->task) {
+            shard_worker_lost(shard, worker);
+            return;
+        }
+        BatchTask* task = &shard->tasks[index];
+        task->output = length > 0 ? (char*)malloc(length) : NULL;
+        if (length > 0 && (!task->output || read_exact_fd(worker->fd, task->output, length) != 0)) {
+            free(task->output);
+            task->output = NULL;
+            shard_worker_lost(shard, worker);
+            return;
+        }
+        task->output_length = length;
+        task->status = status;
+        task->done = 1;
+        worker->task = -1;
+    }
+    if (shard_assign(shard, worker) != 0) shard_worker_lost(shard, worker);
+}
+
+// Runs a manifest on worker_count processes (0: one per core). Returns 0 if
+// every task succeeded.
+static int run_sharded_batch(const char* manifest_path, const CompileOptions* options,
+                             unsigned worker_count, size_t instruction_limit, unsigned time_limit_ms) {
+    char* manifest = read_code_file(manifest_path);
+    if (!manifest) return -1;
+    BatchTask* tasks = NULL;
+    long task_count = parse_manifest(manifest, &tasks);
+    if (task_count < 0) { free(manifest); return -1; }
+
+    // Workers share compiled programs through the cache
+    CompileOptions shared = *options;
+    char temp_dir[4096] = "";
+    if (!shared.cache_dir) {
+        const char* tmp = getenv("TMPDIR");
+        snprintf(temp_dir, sizeof(temp_dir), "%s/bfpp-shard-XXXXXX", (tmp && *tmp) ? tmp : "/tmp");
+        if (!mkdtemp(temp_dir)) {
+            fprintf(stderr, "Error: Cannot create a cache directory: %s\n", strerror(errno));
+            free(tasks);
+            free(manifest);
+            return -1;
+        }
+        shared.cache_dir = temp_dir;
+    }
+
+    Shard shard;
+    memset(&shard, 0, sizeof(shard));
+    shard.tasks = tasks;
+    shard.task_count = (size_t)task_count;
+    shard.options = &shared;
+    shard.instruction_limit = instruction_limit;
+    shard.time_limit_ms = time_limit_ms;
+    shard.sources = (char**)calloc(task_count + 1, sizeof(char*));
+    shard.first = (size_t*)calloc(task_count + 1, sizeof(size_t));
+    shard.retry = (size_t*)calloc(task_count + 1, sizeof(size_t));
+    shard.attempts = (unsigned char*)calloc(task_count + 1, 1);
+    uint64_t* hashes = (uint64_t*)calloc(task_count + 1, sizeof(uint64_t));
+    int status = (shard.sources && shard.first && shard.retry && shard.attempts && hashes) ? 0 : -1;
+
+    // Compile each distinct program once, into the cache
+    for (long i = 0; i < task_count && status == 0; i++) {
+        size_t first = 0;
+        while (strcmp(tasks[first].program_path, tasks[i].program_path) != 0) first++;
+        shard.first[i] = first;
+        if (first < (size_t)i) continue;
+        char* source = read_code_file(tasks[i].program_path);
+        Program* program = source ? compile_program(source, &shared) : NULL;
+        if (program) {
+            hashes[i] = program->code_hash;
+            shard.sources[i] = source;
+        } else {
+            free(source);
+        }
+        free_program(program);
+    }
+    for (long i = 0; i < task_count && status == 0; i++) {
+        if (!shard.sources[shard.first[i]]) {
+            tasks[i].status = -1;
+            tasks[i].done = 1;
+        }
+    }
+
+    if (worker_count == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = cores > 0 ? (unsigned)cores : 1;
+    }
+    if (worker_count > (unsigned long)task_count) worker_count = task_count > 0 ? task_count : 1;
+    shard.workers = (ShardWorker*)calloc(worker_count, sizeof(ShardWorker));
+    if (!shard.workers) status = -1;
+    if (status == 0) {
+        signal(SIGPIPE, SIG_IGN); // A dead worker is noticed by read/write errors
+        shard.worker_count = worker_count;
+        for (unsigned w = 0; w < worker_count; w++) shard.workers[w].fd = -1;
+        for (unsigned w = 0; w < worker_count; w++) {
+            if (start_shard_worker(&shard, &shard.workers[w]) != 0) {
+                fprintf(stderr, "Error: Failed to start a worker process: %s\n", strerror(errno));
+                break;
+            }
+        }
+    }
+    // Skip the tasks of invalid programs when handing out work
+    while (shard.next < shard.task_count && tasks[shard.next].done) shard.next++;
+
+    // Results go out in manifest order as soon as each one is ready
+    struct pollfd* ready = (struct pollfd*)calloc(worker_count, sizeof(struct pollfd));
+    if (!ready) status = -1;
+    size_t written = 0;
+    while (status == 0 && written < shard.task_count) {
+        for (; written < shard.task_count && tasks[written].done; written++) {
+            BatchTask* task = &tasks[written];
+            if (task->output && write_all(STDOUT_FILENO, task->output, task->output_length) != 0) {
+                task->status = -1;
+            }
+            free(task->output);
+            task->output = NULL;
+            if (task->status != 0) {
+                fprintf(stderr, "Error: Line %zu: running '%s' failed.\n", task->line, task->program_path);
+            }
+        }
+
+        unsigned polled = 0;
+        for (unsigned w = 0; w < worker_count; w++) {
+            if (shard.workers[w].pid == 0) continue;
+            ready[polled].fd = shard.workers[w].fd;
+            ready[polled].events = POLLIN;
+            ready[polled].revents = 0;
+            polled++;
+        }
+        if (written < shard.task_count && polled == 0) {
+            // No worker left to run the rest
+            for (size_t i = written; i < shard.task_count; i++) {
+                if (tasks[i].done) continue;
+                tasks[i].status = -1;
+                tasks[i].done = 1;
+            }
+            continue;
+        }
+        if (written == shard.task_count) break;
+        if (poll(ready, polled, -1) < 0) {
+            if (errno == EINTR) continue;
+            status = -1;
+            break;
+        }
+        for (unsigned p = 0; p < polled; p++) {
+            if (!ready[p].revents) continue;
+            for (unsigned w = 0; w < worker_count; w++) {
+                if (shard.workers[w].pid != 0 && shard.workers[w].fd == ready[p].fd) {
+                    shard_receive(&shard, &shard.workers[w]);
+                    break;
+                }
+            }
+        }
+    }
+    free(ready);
+
+    // Closing the sockets tells idle workers to exit
+    for (unsigned w = 0; shard.workers && w < worker_count; w++) {
+        if (shard.workers[w].pid == 0) continue;
+        close(shard.workers[w].fd);
+        waitpid(shard.workers[w].pid, NULL, 0);
+    }
+    for (long i = 0; i < task_count; i++) {
+        if (tasks[i].status != 0) status = -1;
+        free(tasks[i].output);
+    }
+    if (temp_dir[0]) {
+        char path[4096];
+        for (long i = 0; i < task_count; i++) {
+            if (!shard.sources || !shard.sources[i]) continue;
+            cache_path(path, sizeof(path), temp_dir, hashes[i]);
+            unlink(path);
+        }
+        rmdir(temp_dir);
+    }
+    for (long i = 0; shard.sources && i < task_count; i++) free(shard.sources[i]);
+    free(shard.sources);
+    free(shard.first);
+    free(shard.retry);
+    free(shard.attempts);
+    free(shard.workers);
+    free(hashes);
+    free(tasks);
+    free(manifest);
+    return status;
+}
+
+// --- Serve Mode ---
+//
+// --serve PATH listens on a Unix domain socket. A request is one header line
+// followed by input:
+//
+//   PROGRAM <length>\n<length bytes of source><input ...>
+//   HASH <16 hex digits>\n<input ...>
+//
+// Input runs until the client shuts down its side for writing. The reply is
+// "ERR <message>\n", or "OK <hash>\n" followed by the program's output as it
+// is produced, in frames of "DATA <length>\n<length bytes>", and finally
+// "END <reason>\n" with reason done, error, instruction-limit, time-limit or
+// input-timeout. The hash names the program in later HASH requests.
+// Compiled programs are kept in an LRU cache, and connections are served
+// by a pool of --jobs threads. A client that sends nothing for
+// SERVE_READ_TIMEOUT_SECONDS is dropped, so it cannot hold a worker forever.
+
+#define SERVE_HEADER_MAX 64
+#define SERVE_READ_TIMEOUT_SECONDS 30
+#define SERVE_CACHE_SIZE 64     // Compiled programs kept
+#define SERVE_QUEUE_SIZE 256    // Accepted connections waiting for a worker
+
+typedef struct CachedProgram {
+    uint64_t key;               // hash_code of the source
+    char* source;
+    size_t source_length;
+    Program* program;
+    int users;                  // Connections running it; freed when 0 after eviction
+    int evicted;
+    struct CachedProgram* prev; // LRU list, most recently used first
+    struct CachedProgram* next;
+} CachedProgram;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    int queue[SERVE_QUEUE_SIZE];
+    size_t queue_head, queue_length;
+    CachedProgram* lru_head;
+    CachedProgram* lru_tail;
+    size_t cached_count;
+    const CompileOptions* options;
+    size_t instruction_limit;
+    unsigned time_limit_ms;
+} Server;
+
+// A connection, with the bytes already read past the header
+typedef struct {
+    int fd;
+    char buffer[SERVE_HEADER_MAX + 4096];
+    size_t pos, length;
+    int timed_out;              // A read hit SERVE_READ_TIMEOUT_SECONDS
+} ServeConnection;
+
+static long serve_read(void* context, unsigned char* buffer, size_t capacity) {
+    ServeConnection* conn = (ServeConnection*)context;
+    if (conn->pos < conn->length) {
+        size_t n = conn->length - conn->pos;
+        if (n > capacity) n = capacity;
+        memcpy(buffer, conn->buffer + conn->pos, n);
+        conn->pos += n;
+        return (long)n;
+    }
+    long n = read_fd((void*)(intptr_t)conn->fd, buffer, capacity);
+    if (n == BFPP_WOULD_BLOCK) {
+        // SO_RCVTIMEO expired: treat it as an error, not as "try again"
+        conn->timed_out = 1;
+        return -1;
+    }
+    return n;
+}
+
+// MachineIo.write for serve mode: frames the output so the client can tell
+// it apart from the END line
+static int serve_write(void* context, const char* data, size_t length) {
+    ServeConnection* conn = (ServeConnection*)context;
+    char header[32];
+    int header_length = snprintf(header, sizeof(header), "DATA %zu\n", length);
+    if (write_all(conn->fd, header, (size_t)header_length) != 0) return -1;
+    return write_all(conn->fd, data, length);
+}
+
+// Reads exactly length bytes, buffered ones first. Returns 0 on success.
+static int serve_read_exact(ServeConnection* conn, char* data, size_t length) {
+    while (length > 0) {
+        long n = serve_read(conn, (unsigned char*)data, length);
+        if (n <= 0) return -1;
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static void serve_reply(ServeConnection* conn, const char* format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    write_all(conn->fd, line, strlen(line));
+}
+
+static void lru_unlink(Server* server, CachedProgram* entry) {
+    if (entry->prev) entry->prev->next = entry->next; else server->lru_head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev; else server->lru_tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void lru_push_front(Server* server, CachedProgram* entry) {
+    entry->next = server->lru_head;
+    if (server->lru_head) server->lru_head->prev = entry;
+    server->lru_head = entry;
+    if (!server->lru_tail) server->lru_tail = entry;
+}
+
+static void free_cached_program(CachedProgram* entry) {
+    free_program(entry->program);
+    free(entry->source);
+    free(entry);
+}
+
+// Looks key up and marks it used. source may be NULL (HASH request);
+// otherwise it must match too. Called with server->lock held.
+static CachedProgram* lru_acquire(Server* server, uint64_t key, const char* source, size_t length) {
+    for (CachedProgram* entry = server->lru_head; entry; entry = entry->next) {
+        if (entry->key != key) continue;
+        if (source && (entry->source_length != length || memcmp(entry->source, source, length) != 0)) {
+            continue;
+        }
+        lru_unlink(server, entry);
+        lru_push_front(server, entry);
+        entry->users++;
+        return entry;
+    }
+    return NULL;
+}
+
+static void lru_release(Server* server, CachedProgram* entry) {
+    pthread_mutex_lock(&server->lock);
+    int unused = --entry->users == 0 && entry->evicted;
+    pthread_mutex_unlock(&server->lock);
+    if (unused) free_cached_program(entry);
+}
+
+// Adds a freshly compiled program (already counted as used), evicting the
+// least recently used one if the cache is full. Called with server->lock held.
+static void lru_insert(Server* server, CachedProgram* entry) {
+    lru_push_front(server, entry);
+    if (++server->cached_count <= SERVE_CACHE_SIZE) return;
+    CachedProgram* victim = server->lru_tail;
+    lru_unlink(server, victim);
+    server->cached_count--;
+    victim->evicted = 1;
+    if (victim->users == 0) free_cached_program(victim);
+}
+
+// Finds or compiles the program named by a PROGRAM request
+static CachedProgram* serve_compile(Server* server, ServeConnection* conn, size_t length) {
+    char* source = (char*)malloc(length + 1);
+    if (!source) return NULL;
+    if (serve_read_exact(conn, source, length) != 0) {
+        free(source);
+        serve_reply(conn, "ERR truncated program\n");
+        return NULL;
+    }
+    source[length] = '\0';
+    uint64_t key = hash_code(source, length);
+
+    pthread_mutex_lock(&server->lock);
+    CachedProgram* entry = lru_acquire(server, key, source, length);
+    pthread_mutex_unlock(&server->lock);
+    if (entry) {
+        free(source);
+        return entry;
+    }
+
+    // Compiled outside the lock; a concurrent miss on the same source just
+    // compiles it twice
+    entry = (CachedProgram*)calloc(1, sizeof(CachedProgram));
+    if (entry) entry->program = compile_program(source, server->options);
+    if (!entry || !entry->program) {
+        free(entry);
+        free(source);
+        serve_reply(conn, "ERR invalid program\n");
+        return NULL;
+    }
+    entry->key = key;
+    entry->source = source;
+    entry->source_length = length;
+    entry->users = 1;
+    pthread_mutex_lock(&server->lock);
+    lru_insert(server, entry);
+    pthread_mutex_unlock(&server->lock);
+    return entry;
+}
+
+static void serve_connection(Server* server, int fd) {
+    ServeConnection conn;
+    conn.fd = fd;
+    conn.pos = conn.length = 0;
+    conn.timed_out = 0;
+
+    // Read until the header line is complete
+    char* newline = NULL;
+    while (!newline && conn.length < SERVE_HEADER_MAX) {
+        long n = read_fd((void*)(intptr_t)fd, (unsigned char*)conn.buffer + conn.length,
+                         sizeof(conn.buffer) - conn.length);
+        if (n <= 0) return;
+        newline = memchr(conn.buffer + conn.length, '\n', n);
+        conn.length += n;
+    }
+    if (!newline || newline - conn.buffer >= SERVE_HEADER_MAX) {
+        serve_reply(&conn, "ERR header too long\n");
+        return;
+    }
+    *newline = '\0';
+    conn.pos = newline + 1 - conn.buffer;
+
+    CachedProgram* entry = NULL;
+    unsigned long long number;
+    char extra;
+    if (sscanf(conn.buffer, "PROGRAM %llu %c", &number, &extra) == 1) {
+        if (number > MAX_CODE_SIZE * 5) {
+            serve_reply(&conn, "ERR program too large\n");
+            return;
+        }
+        entry = serve_compile(server, &conn, (size_t)number);
+    } else if (sscanf(conn.buffer, "HASH %llx %c", &number, &extra) == 1) {
+        pthread_mutex_lock(&server->lock);
+        entry = lru_acquire(server, (uint64_t)number, NULL, 0);
+        pthread_mutex_unlock(&server->lock);
+        if (!entry) serve_reply(&conn, "ERR unknown program\n");
+    } else {
+        serve_reply(&conn, "ERR bad request\n");
+    }
+    if (!entry) return;
+
+    serve_reply(&conn, "OK %016llx\n", (unsigned long long)entry->key);
+    MachineIo io = fd_io(fd, fd);
+    io.read = serve_read;
+    io.read_context = &conn;
+    io.write = serve_write;
+    io.write_context = &conn;
+    io.interactive = 0;
+    Machine* machine = create_machine(entry->program, &io);
+    ExecStatus status = EXEC_ERROR;
+    if (machine) {
+        set_instruction_limit(machine, server->instruction_limit);
+        set_time_limit(machine, server->time_limit_ms);
+        status = run_machine(machine);
+        free_machine(machine);
+    }
+    lru_release(server, entry);
+
+    const char* reason = "error";
+    if (conn.timed_out) reason = "input-timeout";
+    else if (status == EXEC_DONE) reason = "done";
+    else if (status == EXEC_LIMIT) reason = "instruction-limit";
+    else if (status == EXEC_TIMEOUT) reason = "time-limit";
+    serve_reply(&conn, "END %s\n", reason);
+}
+
+static void* serve_worker_main(void* arg) {
+    Server* server = (Server*)arg;
+    for (;;) {
+        pthread_mutex_lock(&server->lock);
+        while (server->queue_length == 0) pthread_cond_wait(&server->not_empty, &server->lock);
+        int fd = server->queue[server->queue_head];
+        server->queue_head = (server->queue_head + 1) % SERVE_QUEUE_SIZE;
+        server->queue_length--;
+        pthread_cond_signal(&server->not_full);
+        pthread_mutex_unlock(&server->lock);
+
+        struct timeval timeout = { SERVE_READ_TIMEOUT_SECONDS, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        serve_connection(server, fd);
+        // Closing with unread input would reset the connection and could
+        // discard the reply, so end the reply and drain the input first,
+        // giving up after the read timeout in total
+        shutdown(fd, SHUT_WR);
+        char discard[4096];
+        unsigned long drain_until = monotonic_ms() + SERVE_READ_TIMEOUT_SECONDS * 1000UL;
+        while (monotonic_ms() < drain_until
+               && read_fd((void*)(intptr_t)fd, (unsigned char*)discard, sizeof(discard)) > 0) {}
+        close(fd);
+    }
+    return NULL;
+}
+
+// Listens on a Unix domain socket at path. Returns the socket, or -1.
+static int listen_unix(const char* path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long.\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    // Replace a stale socket from an earlier run, but nothing else
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0
+        || listen(listen_fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Error: Cannot listen on '%s': %s\n", path, strerror(errno));
+        if (listen_fd >= 0) close(listen_fd);
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN); // A client going away must not kill the server
+    return listen_fd;
+}
+
+// Serves requests on the socket at path until killed
+static int run_server(const char* path, const CompileOptions* options, unsigned worker_count,
+                      size_t instruction_limit, unsigned time_limit_ms) {
+    int listen_fd = listen_unix(path);
+    if (listen_fd < 0) return -1;
+
+    static Server server; // Shared with the detached workers
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.not_empty, NULL);
+    pthread_cond_init(&server.not_full, NULL);
+    server.options = options;
+    server.instruction_limit = instruction_limit;
+    server.time_limit_ms = time_limit_ms;
+    if (worker_count == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = cores > 0 ? (unsigned)cores : 1;
+    }
+    unsigned started = 0;
+    for (unsigned w = 0; w < worker_count; w++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_worker_main, &server) == 0) {
+            pthread_detach(thread);
+            started++;
+        }
+    }
+    if (started == 0) {
+        fprintf(stderr, "Error: Failed to start worker threads.\n");
+        close(listen_fd);
+        return -1;
+    }
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EMFILE || errno == ENFILE) { usleep(1000); continue; }
+            fprintf(stderr, "Error: accept failed: %s\n", strerror(errno));
+            close(listen_fd);
+            return -1;
+        }
+        pthread_mutex_lock(&server.lock);
+        while (server.queue_length == SERVE_QUEUE_SIZE) pthread_cond_wait(&server.not_full, &server.lock);
+        server.queue[(server.queue_head + server.queue_length) % SERVE_QUEUE_SIZE] = fd;
+        server.queue_length++;
+        pthread_cond_signal(&server.not_empty);
+        pthread_mutex_unlock(&server.lock);
+    }
+}
+
+// --- Fork Server ---
+//
+// --fork-server PATH runs one program for every connection to a Unix domain
+// socket, each in its own process. The parent compiles the program, touches
+// its pages and builds a machine ready to run, once; a child forked per
+// connection inherits all of it copy-on-write and only has to move the
+// connection onto its stdin/stdout. Input runs until the client shuts down
+// writing; the reply is the program's output.
+
+// Brings every page of the compiled program into memory
+static void prefault_program(const Program* program) {
+    const struct { const void* data; size_t size; } regions[] = {
+        { program->cache_mapping, program->cache_mapping_size },
+        { program->code, program->code_length },
+        { program->bracket_map, program->code_length * sizeof(int) },
+        { program->paren_map, program->code_length * sizeof(int) },
+        { program->literal_ops, program->literal_op_count * sizeof(LiteralOp) },
+        { program->literal_bytes, program->literal_bytes_length },
+        { program->literal_deltas, program->literal_delta_count * sizeof(CellDelta) },
+        { program->snapshot, program->snapshot_size },
+    };
+    long page_size = sysconf(_SC_PAGESIZE);
+    volatile unsigned char sink = 0;
+    for (size_t r = 0; r < sizeof(regions) / sizeof(regions[0]); r++) {
+        const unsigned char* data = (const unsigned char*)regions[r].data;
+        if (!data) continue;
+        for (size_t i = 0; i < regions[r].size; i += page_size) sink ^= data[i];
+        if (regions[r].size > 0) sink ^= data[regions[r].size - 1];
+    }
+    (void)sink;
+}
+
+// Runs in the child: the template machine already reads fd 0 and writes fd 1
+static void fork_server_child(Machine* machine, int listen_fd, int fd) {
+    close(listen_fd);
+    signal(SIGPIPE, SIG_DFL);
+    if (dup2(fd, STDIN_FILENO) < 0 || dup2(fd, STDOUT_FILENO) < 0) _exit(EXIT_FAILURE);
+    close(fd);
+    int status = run(machine);
+    // Drain unread input so that closing does not reset the connection
+    shutdown(STDOUT_FILENO, SHUT_WR);
+    char discard[4096];
+    while (read_fd((void*)(intptr_t)STDIN_FILENO, (unsigned char*)discard, sizeof(discard)) > 0) {}
+    _exit(status == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+// Serves program on the socket at path until killed, with at most
+// max_children runs at a time (0: one per core)
+static int run_fork_server(const char* path, const Program* program, unsigned max_children,
+                           size_t instruction_limit, unsigned time_limit_ms) {
+    // The template machine is wired to fds 0 and 1, which point at
+    // /dev/null in the parent and at the connection in each child
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd < 0 || dup2(null_fd, STDIN_FILENO) < 0 || dup2(null_fd, STDOUT_FILENO) < 0) {
+        perror("Error redirecting standard I/O");
+        return -1;
+    }
+    if (null_fd > STDOUT_FILENO) close(null_fd);
+    MachineIo io = fd_io(STDIN_FILENO, STDOUT_FILENO);
+    io.interactive = 0;
+    Machine* machine = create_machine(program, &io);
+    if (!machine) return -1;
+    set_instruction_limit(machine, instruction_limit);
+    set_time_limit(machine, time_limit_ms); // Timed from run() in each child
+    prefault_program(program);
+
+    int listen_fd = listen_unix(path);
+    if (listen_fd < 0) {
+        free_machine(machine);
+        return -1;
+    }
+    if (max_children == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        max_children = cores > 0 ? (unsigned)cores : 1;
+    }
+
+    unsigned children = 0;
+    for (;;) {
+        // Reap finished children; wait for one when at the limit
+        while (children > 0 && waitpid(-1, NULL, children >= max_children ? 0 : WNOHANG) > 0) {
+            children--;
+        }
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EMFILE || errno == ENFILE) { usleep(1000); continue; }
+            fprintf(stderr, "Error: accept failed: %s\n", strerror(errno));
+            break;
+        }
+        pid_t pid = fork();
+        if (pid == 0) fork_server_child(machine, listen_fd, fd);
+        if (pid < 0) perror("Error forking");
+        else children++;
+        close(fd);
+    }
+    close(listen_fd);
+    free_machine(machine);
+    return -1;
+}
+
+// --- Pipeline Mode ---
+//
+// --pipeline a.bfpp b.bfpp ... works like the shell pipeline
+// "a.bfpp | b.bfpp | ...", but inside one process: every stage runs on its
+// own thread and neighbouring stages are connected by lock-free byte rings
+// (the ones --io-thread uses), so data passes between them without system
+// calls. A stage that gets ahead of the next one waits for room in its
+// ring. When a stage finishes, the next one sees the end of its input and
+// the previous one's further output is discarded, as with a closed pipe.
+
+typedef struct {
+    Machine* machine;
+    ByteRing* input;            // From the previous stage, or NULL for stdin
+    ByteRing* output;           // To the next stage, or NULL for stdout
+    pthread_t thread;
+    int status;
+} PipelineStage;
+
+// MachineIo callbacks for a ring between two stages
+static long ring_read(void* context, unsigned char* buffer, size_t capacity) {
+    ByteRing* ring = (ByteRing*)context;
+    const unsigned char* data;
+    size_t n = ring_readable(ring, &data);
+    if (n == 0) return 0;
+    if (n > capacity) n = capacity;
+    memcpy(buffer, data, n);
+    ring_consume(ring, n);
+    return (long)n;
+}
 
-    // --- Create and Run Interpreter ---
-    Interpreter* interp = create_interpreter(code_buffer, stdin, stdout);
+static int ring_write(void* context, const char* data, size_t length) {
+    return ring_push((ByteRing*)context, data, length);
+}
+
+static void close_ring(ByteRing* ring) {
+    if (!ring) return;
+    atomic_store(&ring->closed, 1);
+    ring_wake(ring);
+}
+
+static void* pipeline_stage_main(void* arg) {
+    PipelineStage* stage = (PipelineStage*)arg;
+    stage->status = run(stage->machine);
+    // As in a shell pipeline, a stage cut off by the next one finishing is fine
+    if (stage->output && stage->machine->out.failed && atomic_load(&stage->output->closed)) {
+        stage->status = 0;
+    }
+    close_ring(stage->output); // End of input for the next stage
+    close_ring(stage->input);  // The previous stage's output goes nowhere now
+    return NULL;
+}
+
+// Runs the programs at paths as a pipeline from stdin to stdout. Returns 0
+// if every stage succeeded.
+static int run_pipeline(char** paths, int count, const CompileOptions* options,
+                        size_t instruction_limit, unsigned time_limit_ms, int flush_policy) {
+    Program** programs = (Program**)calloc(count, sizeof(Program*));
+    PipelineStage* stages = (PipelineStage*)calloc(count, sizeof(PipelineStage));
+    ByteRing* rings = (ByteRing*)calloc(count, sizeof(ByteRing));
+    int status = (programs && stages && rings) ? 0 : -1;
+    int ring_count = 0;
+    for (int i = 0; i < count && status == 0; i++) {
+        char* source = read_code_file(paths[i]);
+        programs[i] = source ? compile_program(source, options) : NULL;
+        free(source);
+        if (!programs[i]) status = -1;
+    }
+    for (; ring_count < count - 1 && status == 0; ring_count++) {
+        if (ring_init(&rings[ring_count], IO_RING_SIZE) != 0) status = -1;
+    }
+    for (int i = 0; i < count && status == 0; i++) {
+        PipelineStage* stage = &stages[i];
+        MachineIo io = fd_io(i == 0 ? STDIN_FILENO : -1, i == count - 1 ? STDOUT_FILENO : -1);
+        if (i > 0) {
+            stage->input = &rings[i - 1];
+            io.read = ring_read;
+            io.read_context = stage->input;
+            io.interactive = 0;
+        }
+        if (i < count - 1) {
+            stage->output = &rings[i];
+            io.write = ring_write;
+            io.write_context = stage->output;
+        }
+        stage->machine = create_machine(programs[i], &io);
+        if (!stage->machine) {
+            status = -1;
+            break;
+        }
+        set_instruction_limit(stage->machine, instruction_limit);
+        set_time_limit(stage->machine, time_limit_ms);
+        if (flush_policy >= 0) set_flush_policy(stage->machine, (FlushPolicy)flush_policy);
+    }
+
+    if (status == 0) {
+        // The last stage runs on this thread
+        int started = 0;
+        while (started < count - 1
+               && pthread_create(&stages[started].thread, NULL, pipeline_stage_main, &stages[started]) == 0) {
+            started++;
+        }
+        if (started < count - 1) {
+            fprintf(stderr, "Error: Failed to start a pipeline thread.\n");
+            // Let the running stages see the end of their input and output
+            for (int r = 0; r < ring_count; r++) close_ring(&rings[r]);
+            status = -1;
+        } else {
+            pipeline_stage_main(&stages[count - 1]);
+        }
+        for (int i = 0; i < started; i++) pthread_join(stages[i].thread, NULL);
+        for (int i = 0; i < count && status == 0; i++) {
+            if (stages[i].status != 0) status = -1;
+        }
+    }
+
+    for (int i = 0; stages && i < count; i++) free_machine(stages[i].machine);
+    for (int i = 0; programs && i < count; i++) free_program(programs[i]);
+    for (int r = 0; r < ring_count; r++) free(rings[r].data);
+    free(rings);
+    free(stages);
+    free(programs);
+    return status;
+}
+
+// --- Main Program Entry ---
+
+static void print_usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [options] <filename.bfpp>\n", prog);
+    fprintf(stderr, "       %s [options] --batch MANIFEST\n", prog);
+    fprintf(stderr, "       %s [options] --serve SOCKET\n", prog);
+    fprintf(stderr, "       %s [options] --fork-server SOCKET <filename.bfpp>\n", prog);
+    fprintf(stderr, "       %s [options] --pipeline <a.bfpp> <b.bfpp> ...\n", prog);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --cache-dir DIR   Reuse compiled code from DIR (default: $BFPP_CACHE_DIR)\n");
+    fprintf(stderr, "  --prefix-budget-ms N  Time to spend running the input-free prefix when\n"
+                    "                    filling the cache (default: %d, 0 disables)\n", DEFAULT_PREFIX_BUDGET_MS);
+    fprintf(stderr, "  --emit-c FILE     Write the program as C source for a shared library and exit\n");
+    fprintf(stderr, "  --emit-so FILE    Compile the program into a shared library exporting bfpp_main and exit\n");
+    fprintf(stderr, "  --flush=POLICY    block, line (default on a terminal) or interactive\n");
+    fprintf(stderr, "  --io=MODE         byte (default), or cell32/cell64: '.' and ',' move whole\n"
+                    "                    cells as native-endian 32/64-bit integers\n");
+    fprintf(stderr, "  --profile         Report the hottest loops by source line:column on exit\n");
+    fprintf(stderr, "  --trace           Print every command and its effect to stderr as it runs\n");
+    fprintf(stderr, "  --stats           Report the number of instructions executed on exit\n");
+    fprintf(stderr, "  --io-thread       Do reads and writes on background threads\n");
+    fprintf(stderr, "  --parallel-regions  Run consecutive () blocks that touch disjoint cells\n"
+                    "                    on several threads\n");
+    fprintf(stderr, "  --max-instructions N  Stop after N instructions (default: %d, 0 = unlimited)\n",
+            MAX_INSTRUCTIONS);
+    fprintf(stderr, "  --checkpoint-every N  Save the whole state every N seconds, to resume it\n"
+                    "                    with --restore after the run is interrupted\n");
+    fprintf(stderr, "  --checkpoint FILE Where to save it (default: the program's path + .checkpoint)\n");
+    fprintf(stderr, "  --restore FILE    Continue from a checkpoint, given the same input from the start\n");
+    fprintf(stderr, "  --timeout-ms N    Stop a run after N milliseconds of wall-clock time (default: 0,\n"
+                    "                    unlimited); checked where loops jump back and between\n"
+                    "                    chunks of input copied by a ,[.,] loop\n");
+    fprintf(stderr, "  --batch MANIFEST  Run every \"PROGRAM [INPUT|- [OUTPUT]]\" line of MANIFEST\n");
+    fprintf(stderr, "  --simt            With --batch, run up to %d tasks of the same program\n"
+                    "                    in lockstep (not with --processes)\n", SIMT_LANES);
+    fprintf(stderr, "  --processes N     With --batch, run the tasks in N worker processes that\n"
+                    "                    share compiled programs through the cache (0: one per core)\n");
+    fprintf(stderr, "  --serve SOCKET    Run programs sent to the Unix domain socket SOCKET\n");
+    fprintf(stderr, "  --fork-server SOCKET  Run the program in a forked process for every\n"
+                    "                    connection to SOCKET\n");
+    fprintf(stderr, "  --pipeline A B ...  Run the programs like \"A | B | ...\", each on its own\n"
+                    "                    thread, connected by in-memory ring buffers\n");
+    fprintf(stderr, "  --jobs N          Worker threads for --batch and --serve, processes for\n"
+                    "                    --fork-server (default: one per core)\n");
+}
+
+// Matches "--name value" and "--name=value"; advances *i past a separate value.
+// Returns the value, or NULL if argv[*i] is not this option.
+static const char* option_value(int argc, char* argv[], int* i, const char* name) {
+    size_t len = strlen(name);
+    if (strncmp(argv[*i], name, len) != 0) return NULL;
+    if (argv[*i][len] == '=') return argv[*i] + len + 1;
+    if (argv[*i][len] != '\0') return NULL;
+    if (*i + 1 >= argc) {
+        fprintf(stderr, "Error: Option %s requires a value.\n", name);
+        exit(EXIT_FAILURE);
+    }
+    return argv[++*i];
+}
+
+int main(int argc, char* argv[]) {
+    const char* filename = NULL;
+    CompileOptions options = { getenv("BFPP_CACHE_DIR"), DEFAULT_PREFIX_BUDGET_MS, 1, 0 };
+    const char* value;
+    int profile = 0;
+    int trace = 0;
+    int stats = 0;
+    int io_thread = 0;
+    int lockstep = 0;
+    int flush_policy = -1;
+    const char* emit_c_path = NULL;
+    const char* emit_so_path = NULL;
+    const char* batch_path = NULL;
+    const char* serve_path = NULL;
+    const char* fork_server_path = NULL;
+    char** pipeline_paths = NULL;
+    int pipeline_count = -1;
+    unsigned jobs = 0;
+    long processes = -1;
+    size_t max_instructions = MAX_INSTRUCTIONS;
+    unsigned timeout_ms = 0;
+    unsigned checkpoint_seconds = 0;
+    const char* checkpoint_path = NULL;
+    const char* restore_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if ((value = option_value(argc, argv, &i, "--cache-dir"))) {
+            options.cache_dir = value;
+        } else if ((value = option_value(argc, argv, &i, "--prefix-budget-ms"))) {
+            options.prefix_budget_ms = (unsigned)strtoul(value, NULL, 10);
+        } else if ((value = option_value(argc, argv, &i, "--emit-c"))) {
+            emit_c_path = value;
+        } else if ((value = option_value(argc, argv, &i, "--emit-so"))) {
+            emit_so_path = value;
+        } else if ((value = option_value(argc, argv, &i, "--io"))) {
+            if (strcmp(value, "byte") == 0) options.io_cell_size = 1;
+            else if (strcmp(value, "cell32") == 0) options.io_cell_size = 4;
+            else if (strcmp(value, "cell64") == 0) options.io_cell_size = 8;
+            else {
+                fprintf(stderr, "Error: Unknown I/O mode '%s'.\n", value);
+                return EXIT_FAILURE;
+            }
+        } else if ((value = option_value(argc, argv, &i, "--flush"))) {
+            if (strcmp(value, "block") == 0) flush_policy = FLUSH_BLOCK;
+            else if (strcmp(value, "line") == 0) flush_policy = FLUSH_LINE;
+            else if (strcmp(value, "interactive") == 0) flush_policy = FLUSH_INTERACTIVE;
+            else {
+                fprintf(stderr, "Error: Unknown flush policy '%s'.\n", value);
+                return EXIT_FAILURE;
+            }
+        } else if ((value = option_value(argc, argv, &i, "--batch"))) {
+            batch_path = value;
+        } else if ((value = option_value(argc, argv, &i, "--serve"))) {
+            serve_path = value;
+        } else if ((value = option_value(argc, argv, &i, "--fork-server"))) {
+            fork_server_path = value;
+        } else if ((value = option_value(argc, argv, &i, "--max-instructions"))) {
+            max_instructions = (size_t)strtoull(value, NULL, 10);
+        } else if ((value = option_value(argc, argv, &i, "--timeout-ms"))) {
+            timeout_ms = (unsigned)strtoul(value, NULL, 10);
+        } else if ((value = option_value(argc, argv, &i, "--checkpoint-every"))) {
+            checkpoint_seconds = (unsigned)strtoul(value, NULL, 10);
+        } else if ((value = option_value(argc, argv, &i, "--checkpoint"))) {
+            checkpoint_path = value;
+        } else if ((value = option_value(argc, argv, &i, "--restore"))) {
+            restore_path = value;
+        } else if ((value = option_value(argc, argv, &i, "--processes"))) {
+            processes = strtol(value, NULL, 10);
+        } else if ((value = option_value(argc, argv, &i, "--jobs"))) {
+            jobs = (unsigned)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile = 1;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            trace = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[i], "--io-thread") == 0) {
+            io_thread = 1;
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            // Every following argument up to the next option is a stage
+            pipeline_paths = &argv[i + 1];
+            pipeline_count = 0;
+            while (i + 1 < argc && argv[i + 1][0] != '-') {
+                i++;
+                pipeline_count++;
+            }
+        } else if (strcmp(argv[i], "--simt") == 0) {
+            lockstep = 1;
+        } else if (strcmp(argv[i], "--parallel-regions") == 0) {
+            long cores = sysconf(_SC_NPROCESSORS_ONLN);
+            options.parallel_regions = cores > 1 ? (unsigned)cores : 2;
+        } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            fprintf(stderr, "Error: Unknown option '%s'.\n", argv[i]);
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        } else if (!filename) {
+            filename = argv[i];
+        } else {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if ((filename != NULL) + (batch_path != NULL) + (serve_path != NULL) + (pipeline_count >= 0) != 1
+        || pipeline_count == 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (options.cache_dir && options.cache_dir[0] == '\0') options.cache_dir = NULL;
+    if ((checkpoint_seconds || restore_path) && !filename) {
+        fprintf(stderr, "Error: --checkpoint-every and --restore only apply to a single program.\n");
+        return EXIT_FAILURE;
+    }
+    if (lockstep && (!batch_path || processes >= 0)) {
+        fprintf(stderr, "Error: --simt only applies to --batch without --processes.\n");
+        return EXIT_FAILURE;
+    }
+    if (pipeline_paths) {
+        return run_pipeline(pipeline_paths, pipeline_count, &options, max_instructions, timeout_ms,
+                            flush_policy) == 0
+            ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (batch_path && processes >= 0) {
+        return run_sharded_batch(batch_path, &options, (unsigned)processes, max_instructions, timeout_ms) == 0
+            ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (batch_path) {
+        return run_batch(batch_path, &options, jobs, max_instructions, timeout_ms, lockstep) == 0
+            ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (serve_path) {
+        return run_server(serve_path, &options, jobs, max_instructions, timeout_ms) == 0
+            ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if ((emit_c_path || emit_so_path) && options.io_cell_size != 1) {
+        // bfpp_main's read/write callbacks move single bytes
+        fprintf(stderr, "Error: --emit-c and --emit-so only support --io=byte.\n");
+        return EXIT_FAILURE;
+    }
+
+    // --- Read Code File ---
+    char* code_buffer = read_code_file(filename);
+    if (!code_buffer) return EXIT_FAILURE;
+
+    // --- Compile and Run ---
+    Program* program = compile_program(code_buffer, &options);
+    Machine* machine = NULL;
     int run_status = -1;
 
-    if (interp) {
-        run_status = run(interp);
-        fflush(interp->output); // Ensure all output is written
-        free_interpreter(interp);
+    if (program && (emit_c_path || emit_so_path)) {
+        // Compile-only: emit the program instead of running it
+        run_status = 0;
+        if (emit_c_path) {
+            FILE* out = strcmp(emit_c_path, "-") == 0 ? stdout : fopen(emit_c_path, "w");
+            if (!out) {
+                perror("Error opening C output file");
+                run_status = -1;
+            } else {
+                if (emit_c_source(program, out) != 0) run_status = -1;
+                if (out != stdout && fclose(out) != 0) run_status = -1;
+            }
+        }
+        if (emit_so_path && run_status == 0) {
+            run_status = emit_shared_library(program, emit_so_path);
+        }
+    } else if (program && fork_server_path) {
+        run_status = run_fork_server(fork_server_path, program, jobs, max_instructions, timeout_ms);
+    } else if (program) {
+        MachineIo io = fd_io(STDIN_FILENO, STDOUT_FILENO);
+        machine = create_machine(program, &io);
+    }
+
+    if (machine && profile && enable_profiling(machine, code_buffer) != 0) {
+        fprintf(stderr, "Error: Failed to allocate memory for profiling.\n");
+        free_machine(machine);
+        machine = NULL;
+    }
+
+    if (machine && trace) enable_tracing(machine);
+    if (machine) set_instruction_limit(machine, max_instructions);
+    if (machine) set_time_limit(machine, timeout_ms);
+    if (machine && flush_policy >= 0) set_flush_policy(machine, (FlushPolicy)flush_policy);
+
+    char default_checkpoint[4096];
+    if (machine && checkpoint_seconds) {
+        if (!checkpoint_path) {
+            snprintf(default_checkpoint, sizeof(default_checkpoint), "%s.checkpoint", filename);
+            checkpoint_path = default_checkpoint;
+        }
+        set_checkpointing(machine, checkpoint_path, checkpoint_seconds * 1000);
+    }
+    if (machine && restore_path && restore_checkpoint(machine, restore_path) != 0) {
+        free_machine(machine);
+        machine = NULL;
+    }
+
+    if (machine && io_thread && start_io_threads(machine) != 0) {
+        fprintf(stderr, "Warning: Failed to start I/O threads; doing I/O directly.\n");
+    }
+
+    if (machine) {
+        run_status = run(machine);
+        print_profile(machine, stderr);
+        if (stats) fprintf(stderr, "Instructions executed: %zu\n", instructions_executed(machine));
+        free_machine(machine);
     }
+    free_program(program);
 
     // --- Cleanup ---
     free(code_buffer); // Free the raw code buffer read from file
@@ -624,3 +5305,4 @@ int main(int argc, char* argv[]) {
     return (run_status == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
+#endif // BFPP_NO_MAIN
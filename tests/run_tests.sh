@@ -0,0 +1,159 @@
+#!/bin/bash
+# 回归测试：在每种执行模式下运行examples/和tests/programs/中的程序，
+# 把输出与tests/expected/中的期望输出逐字节比较。
+#
+#   tests/run_tests.sh [解释器]
+#
+# 不指定解释器时先把brainfuckpp_interpreter.c编译到临时目录中。
+# tests/programs/NAME.in（如果存在）是NAME.bfpp的输入，其余程序没有输入。
+
+cd "$(dirname "$0")/.." || exit 1
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+bfpp=$1
+if [ -z "$bfpp" ]; then
+    bfpp=$work/brainfuckpp
+    ${CC:-gcc} -O2 -Wall -Wextra -pthread -o "$bfpp" brainfuckpp_interpreter.c || exit 1
+fi
+
+passed=0
+failed=0
+
+# check NAME ACTUAL_FILE EXPECTED_FILE
+check() {
+    if cmp -s "$2" "$3"; then
+        passed=$((passed + 1))
+    else
+        failed=$((failed + 1))
+        echo "FAIL: $1"
+    fi
+}
+
+cases=()
+for program in examples/*.bfpp tests/programs/*.bfpp; do
+    cases+=("$(basename "$program" .bfpp):$program")
+done
+
+input_of() {
+    local input=tests/programs/$1.in
+    [ -f "$input" ] && echo "$input" || echo /dev/null
+}
+
+# --- 单个程序的各种模式 ---
+
+modes=(
+    "plain:"
+    "cache:--cache-dir $work/cache"
+    "cache-hit:--cache-dir $work/cache"
+    "cache-hit-profile:--cache-dir $work/cache --profile"
+    "parallel:--parallel-regions"
+    "io-thread:--io-thread"
+    "profile:--profile"
+    "trace:--trace"
+)
+for mode in "${modes[@]}"; do
+    name=${mode%%:*}
+    options=${mode#*:}
+    for entry in "${cases[@]}"; do
+        program_name=${entry%%:*}
+        program=${entry#*:}
+        # stderr中是--profile和--trace的报告，只比较stdout
+        "$bfpp" $options "$program" < "$(input_of "$program_name")" > "$work/out" 2> /dev/null
+        status=$?
+        if [ $status -ge 128 ]; then
+            failed=$((failed + 1))
+            echo "FAIL: $name $program_name (killed by signal $((status - 128)))"
+            continue
+        fi
+        check "$name $program_name" "$work/out" "tests/expected/$program_name.out"
+    done
+done
+
+# --- 批量运行 ---
+
+manifest=$work/manifest
+: > "$manifest"
+for entry in "${cases[@]}"; do
+    program_name=${entry%%:*}
+    input=$(input_of "$program_name")
+    [ "$input" = /dev/null ] && input=-
+    echo "${entry#*:} $input $work/batch/$program_name.out" >> "$manifest"
+done
+for options in "" "--simt" "--processes 2"; do
+    rm -rf "$work/batch"
+    mkdir "$work/batch"
+    "$bfpp" --batch "$manifest" $options 2> /dev/null
+    for entry in "${cases[@]}"; do
+        program_name=${entry%%:*}
+        check "batch $options $program_name" "$work/batch/$program_name.out" "tests/expected/$program_name.out"
+    done
+done
+
+# --- 流水线 ---
+
+"$bfpp" --pipeline examples/hello_world.bfpp tests/programs/cat.bfpp < /dev/null > "$work/out" 2> /dev/null
+check "pipeline hello_world | cat" "$work/out" tests/expected/hello_world.out
+"$bfpp" --pipeline tests/programs/cat.bfpp tests/programs/cat.bfpp tests/programs/cat.bfpp \
+    < tests/programs/cat.in > "$work/out" 2> /dev/null
+check "pipeline cat | cat | cat" "$work/out" tests/expected/cat.out
+
+# --- 指令数与时间限制 ---
+#
+# 达到限制时解释器在stderr中打印警告并正常退出（状态0）。
+
+# expect_stop NAME WARNING INPUT 命令...
+expect_stop() {
+    local name=$1 warning=$2 input=$3
+    shift 3
+    # 停不下来的运行由timeout结束，状态为124
+    timeout 10 "$@" < "$input" > /dev/null 2> "$work/err"
+    local status=$?
+    if [ $status -ne 0 ]; then
+        failed=$((failed + 1))
+        echo "FAIL: $name (exit status $status)"
+    elif ! grep -qF "Warning: $warning" "$work/err"; then
+        failed=$((failed + 1))
+        echo "FAIL: $name (no \"$warning\" warning)"
+    else
+        passed=$((passed + 1))
+    fi
+}
+
+limit="Maximum instruction limit reached."
+expect_stop "instruction limit hello_world" "$limit" /dev/null \
+    "$bfpp" --max-instructions 100 examples/hello_world.bfpp
+expect_stop "instruction limit forever" "$limit" /dev/null \
+    "$bfpp" --max-instructions 100000 tests/limits/forever.bfpp
+# 输入无穷无尽时，复制循环由默认的指令数限制停下
+expect_stop "instruction limit cat < yes" "$limit" <(yes) "$bfpp" tests/programs/cat.bfpp
+
+time="Time limit reached."
+expect_stop "time limit forever" "$time" /dev/null \
+    "$bfpp" --max-instructions 0 --timeout-ms 200 tests/limits/forever.bfpp
+for options in "" "--io-thread"; do
+    expect_stop "time limit cat < yes${options:+ $options}" "$time" <(yes) \
+        "$bfpp" $options --max-instructions 0 --timeout-ms 200 tests/programs/cat.bfpp
+done
+
+# --- 检查点 ---
+#
+# 第一次运行每秒保存一次检查点，并在完成前被--timeout-ms打断；从检查点
+# 恢复的运行追加到同一个输出文件后，结果应与不间断运行完全相同。
+
+for options in "" "--io-thread"; do
+    checkpoint=$work/slow.checkpoint
+    rm -f "$checkpoint"
+    # 输出文件中已有的内容比检查点文件大，恢复时两者的大小不能混淆
+    head -c 10000 /dev/zero > "$work/out"
+    cp "$work/out" "$work/expected"
+    cat tests/checkpoint/slow.out >> "$work/expected"
+    "$bfpp" $options --max-instructions 0 --timeout-ms 1800 --checkpoint-every 1 --checkpoint "$checkpoint" \
+        tests/checkpoint/slow.bfpp < tests/checkpoint/slow.in >> "$work/out" 2> /dev/null
+    "$bfpp" $options --max-instructions 0 --restore "$checkpoint" \
+        tests/checkpoint/slow.bfpp < tests/checkpoint/slow.in >> "$work/out" 2> /dev/null
+    check "checkpoint/restore $options" "$work/out" "$work/expected"
+done
+
+echo "$passed passed, $failed failed"
+[ $failed -eq 0 ]